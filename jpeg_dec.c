@@ -3,11 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jpeg_dec.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JD_X86 1
+#include <immintrin.h>
+#endif
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 typedef signed char s8;
 typedef signed short s16;
 typedef signed int s32;
@@ -15,7 +31,12 @@ typedef signed int s32;
 #define DCTSIZE 8
 #define DCTSIZE2 64
 
+#define MCU_MAX_BLOCKS 10
+#define MCU_LINE_SLOTS 3        /* mcu lines kept for vertical upsampling */
+
 #define VLC_MAX_LEN 16
+#define VLC_LOOKAHEAD 9         /* bits resolved by one table lookup */
+#define ARENA_ALIGN 64          /* cache line */
 
 #define M_SOI 0xffd8             // Start of image
 #define M_EOI 0xffd9             // End of image
@@ -23,7 +44,7 @@ typedef signed int s32;
 #define M_APPn 0xffef            
 #define M_DQT 0xffdb             // Define quantization table
 #define M_SOF0 0xffc0            // Baseline DCT
-#define M_SOF2 0xffc2            // Baseline DCT
+#define M_SOF2 0xffc2            // Progressive DCT
 #define M_DHT 0xffc4             // Define Huffman table
 #define M_SOS 0xffda             // Start of scan
 #define M_DRI 0xffdd             // Define restart interval
@@ -31,62 +52,123 @@ typedef signed int s32;
 
 enum { D_ERROR = 0, D_INFO, D_MARKER, D_COEFF, D_VERBOSE };
 
-static int _debug_level = D_COEFF;
+// logs above JD_LOG_LEVEL are compiled out, build with
+// -DJD_LOG_LEVEL=D_VERBOSE to trace headers, blocks and codes
+#ifndef JD_LOG_LEVEL
+#define JD_LOG_LEVEL D_ERROR
+#endif
 
 #define _log(LEV, ...)                          \
     do {                                        \
-        if (_debug_level >= (LEV))              \
-            printf(__VA_ARGS__);                \
+        if ((LEV) <= JD_LOG_LEVEL)              \
+            fprintf((LEV) == D_ERROR ? stderr : stdout, __VA_ARGS__); \
     } while (0)
 
-struct s_bctx {
-    u8 *r_data;
-    int len;
-    int r_ptr;
-    int rb_buf;                 /* bits buffer */
-    int rb_bits;                /* bits for rb_buf holds */
-    int r_eof;
+// stage timers of JD_BENCH builds, on while the ctx asks for them, and
+// counters of JD_STATS builds. each thread adds to its own slots, which
+// go to the ctx when the thread is done with the image
+#ifdef JD_STATS
+struct s_jcount {
+    u64 blocks;
+    u64 blocks_skipped;
+    u64 restarts;
+    u64 eob[DCTSIZE2];
 };
 
-int
-_get_file_content(const char *filename, u8 **content, long *len) {
-    FILE *fp = fopen(filename, "rb");
-    if ( fp ) {
-        fseek(fp, 0, SEEK_END);
-        *len = ftell(fp);
-        *content = malloc( *len );
-        if ( content ) {
-            memset(*content, 0, *len);
-            rewind(fp);
-            fread(*content, 1, *len, fp);
-        }
-        fclose(fp);
-        return 1;
-    }
-    return 0;
+static __thread struct s_jcount _count;
+
+#define STAT_ADD(f, n) do { _count.f += (n); } while (0)
+#define STAT_BEGIN() memset(&_count, 0, sizeof(_count))
+#define STAT_END(j)                                                     \
+    do {                                                                \
+        int _k;                                                         \
+        __sync_fetch_and_add(&(j)->stats.blocks, _count.blocks);        \
+        __sync_fetch_and_add(&(j)->stats.blocks_skipped, _count.blocks_skipped); \
+        __sync_fetch_and_add(&(j)->stats.restarts, _count.restarts);    \
+        for (_k=0; _k<DCTSIZE2; _k++)                                   \
+            __sync_fetch_and_add(&(j)->stats.eob[_k], _count.eob[_k]);  \
+    } while (0)
+#else
+#define STAT_ADD(f, n) do {} while (0)
+#define STAT_BEGIN() do {} while (0)
+#define STAT_END(j) do {} while (0)
+#endif
+
+#ifdef JD_BENCH
+static __thread u64 _stage_ticks[JD_STAGES];
+static double _stage_ns_per_tick = 1.0;
+
+static inline u64
+_stage_now(void) {
+#ifdef JD_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
 }
 
-void
-_free_file_content(u8 *content) {
-    if (content) free(content);
+// tsc ticks to ns against the monotonic clock, once from _init_dispatch
+static void
+_stage_calibrate(void) {
+#ifdef JD_X86
+    struct timespec t0, t1;
+    u64 c0, ns;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = __rdtsc();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+    } while (ns < 10000000);
+    _stage_ns_per_tick = (double)ns / (__rdtsc() - c0);
+#endif
 }
 
-struct s_bctx*
-_create_bctx( u8 *content, u32 len ) {
-    struct s_bctx *b = malloc(sizeof(*b));
-    if ( b ) {
-        memset(b, 0, sizeof(*b));
-        b->r_data = content;
-        b->len = len;
-    }
-    return b;
-}
+#define STAGE_MARK(j, t) u64 t = (j)->timing ? _stage_now() : 0
+#define STAGE_ADD(j, st, t)                     \
+    do {                                        \
+        if ( (j)->timing ) {                    \
+            u64 _now = _stage_now();            \
+            _stage_ticks[st] += _now - (t);     \
+            (t) = _now;                         \
+        }                                       \
+    } while (0)
+#define STAGE_BEGIN()                                                   \
+    do {                                                                \
+        memset(_stage_ticks, 0, sizeof(_stage_ticks));                  \
+        STAT_BEGIN();                                                   \
+    } while (0)
+#define STAGE_END(j)                                                    \
+    do {                                                                \
+        int _i;                                                         \
+        STAT_END(j);                                                    \
+        for (_i=0; _i<JD_STAGES; _i++)                                  \
+            __sync_fetch_and_add(&(j)->stage_ticks[_i], _stage_ticks[_i]); \
+    } while (0)
+#else
+#define STAGE_MARK(j, t)
+#define STAGE_ADD(j, st, t) do {} while (0)
+#define STAGE_BEGIN() STAT_BEGIN()
+#define STAGE_END(j) STAT_END(j)
+#endif
+
+struct s_bctx {
+    const u8 *r_data;
+    int len;
+    int r_ptr;
+    u64 rb_buf;                 /* bits buffer, msb aligned */
+    int rb_bits;                /* bits for rb_buf holds */
+    int r_eof;
+    int r_marker;               /* marker met, stop fetching until bits clear */
+    int r_bad;                  /* scan cut short by bad or missing data */
+};
 
 void
-_destroy_bctx(struct s_bctx *b) {
-    if ( b ) {
-        free(b);
-    }
+_init_bctx(struct s_bctx *b, const u8 *data, int len) {
+    memset(b, 0, sizeof(*b));
+    b->r_data = data;
+    b->len = len;
 }
 
 void
@@ -108,6 +190,11 @@ _skip_bytes(struct s_bctx *b, int n) {
 
 u8
 _next_byte(struct s_bctx *b) {
+    if (b->r_ptr >= b->len) {   /* truncated, never read past the input */
+        b->r_ptr++;
+        b->r_eof = 1;
+        return 0;
+    }
     return b->r_data[b->r_ptr++];
 }
 
@@ -117,7 +204,7 @@ _next_word(struct s_bctx *b) {
     return b1<<8 | _next_byte(b);
 }
 
-u8*
+const u8*
 _get_ptr(struct s_bctx *b) {
     return &b->r_data[b->r_ptr];
 }
@@ -137,47 +224,63 @@ _set_eof(struct s_bctx *b) {
     b->r_eof = 1;
 }
 
-u32
-_bits_try(struct s_bctx *b, int n) {
-    u8 buf;
-    u32 data = 0;
-    assert(n <= 32);
-    while (b->rb_bits < n) {
-        if ( _is_eof(b) ) {
-            b->rb_buf = (b->rb_buf << 8) | 0xff;
-            b->rb_bits += 8;
-            continue;
-        }
-        buf = _next_byte(b);
-        b->rb_buf <<= 8;
-        b->rb_buf |= buf;
-        b->rb_bits += 8;
-        if (buf == 0xff) {
-            u16 marker = _next_byte(b);
-            switch( marker ) {
-                case 0x00:
-                case 0xff:
-                    break;
-                case (M_EOI & 0xff):
+// slow path, one byte a time, handle stuffing and stop at marker
+static void
+_bits_fill_slow(struct s_bctx *b) {
+    while (b->rb_bits <= 56) {
+        u64 buf = 0xff;         /* pad 1s after marker or eof */
+        if ( !_is_eof(b) && !b->r_marker ) {
+            buf = _next_byte(b);
+            if (buf == 0xff) {
+                u8 marker = _is_eof(b) ? 0 : _next_byte(b);
+                while (marker == 0xff && !_is_eof(b)) { /* fill bytes */
+                    marker = _next_byte(b);
+                }
+                if ( marker ) {
+                    // RSTn or end of scan, leave it to scan
                     _skip_bytes(b, -2);
-                    _set_eof(b);
-                    break;
-                default:
-                    _log(D_ERROR, "# Should not reach here ! #\n");
-                    assert(0);
+                    b->r_marker = 1;
+                    if (marker == (M_EOI & 0xff)) {
+                        _set_eof(b);
+                    }
+                }
             }
         }
+        b->rb_buf |= buf << (56 - b->rb_bits);
+        b->rb_bits += 8;
     }
-    data = b->rb_buf >> (b->rb_bits-n);
-    return data;
+}
+
+// fast path, take whole bytes in one go when no 0xff among next 8 bytes
+static void
+_bits_fill(struct s_bctx *b) {
+    if (!b->r_marker && b->r_ptr + 8 <= b->len) {
+        const u8 *p = &b->r_data[b->r_ptr];
+        u64 w = ((u64)p[0] << 56) | ((u64)p[1] << 48) | ((u64)p[2] << 40) | ((u64)p[3] << 32)
+            | ((u64)p[4] << 24) | ((u64)p[5] << 16) | ((u64)p[6] << 8) | (u64)p[7];
+        u64 nw = ~w;
+        if (!((nw - 0x0101010101010101ULL) & ~nw & 0x8080808080808080ULL)) {
+            int n = (63 - b->rb_bits) >> 3;
+            b->rb_buf |= (w & (~0ULL << (64 - (n << 3)))) >> b->rb_bits;
+            b->rb_bits += n << 3;
+            b->r_ptr += n;
+            return;
+        }
+    }
+    _bits_fill_slow(b);
+}
+
+u32
+_bits_try(struct s_bctx *b, int n) {
+    if (b->rb_bits < n)
+        _bits_fill(b);
+    return (u32)(b->rb_buf >> (64 - n));
 }
 
 void
 _bits_skip(struct s_bctx *b, int n) {
-    if (b->rb_bits >= n) {
-        b->rb_bits -= n;        
-        b->rb_buf &= ((1<<b->rb_bits) - 1);
-    }
+    b->rb_buf <<= n;
+    b->rb_bits -= n;
 }
 
 u32
@@ -191,6 +294,7 @@ void
 _bits_clear(struct s_bctx *b) {
     b->rb_buf = 0;
     b->rb_bits = 0;
+    b->r_marker = 0;
 }
 
 struct s_ht_vlc {
@@ -200,12 +304,47 @@ struct s_ht_vlc {
 
 struct s_ht_ary {
     u8 count;                   /* vlc list count */
-    struct s_ht_vlc *v;
+    struct s_ht_vlc *v;         /* into vlc of the table */
 };
 
+// the 4 of an image are contiguous and cache line aligned in the arena,
+// what decoding reads comes first
 struct s_ht_tbl {
-    u8 count;                   /* vlc pairs count */
+    /* compiled from ary */
+    s32 fast[1<<VLC_LOOKAHEAD]; /* val<<16 | code<<8 | vlc+extra bits, 0 for none */
+    u16 look[1<<VLC_LOOKAHEAD]; /* vlc len<<8 | code, 0 for longer vlc */
+    s32 maxcode[VLC_MAX_LEN+1]; /* max vlc of length n, -1 for none */
+    s32 valptr[VLC_MAX_LEN+1];  /* huffval index of length n minus first vlc */
+    u8 huffval[256];            /* codes in vlc order */
+
+    int count;                  /* vlc pairs count */
     struct s_ht_ary ary[VLC_MAX_LEN];    /* 0~15 bits */
+    struct s_ht_vlc vlc[256];   /* all vlc pairs, by length */
+    u64 hash;                   /* of the DHT counts and codes */
+} __attribute__((aligned(ARENA_ALIGN)));
+
+// what one DHT table defines
+struct s_ht_key {
+    u8 bits[VLC_MAX_LEN];       /* vlc count of each length */
+    u8 vals[256];
+    int count;
+    u64 hash;
+};
+
+struct s_qt_tbl {
+    u16 q[DCTSIZE2];            /* zigzag order, as DQT gives them */
+    u64 hash;
+};
+
+struct s_jcomp;
+
+// what one block of the mcu reads, resolved once a scan
+struct s_mcu_blk {
+    struct s_jcomp *c;
+    const struct s_ht_tbl *dc, *ac;
+    const u16 *q;               /* quant, zigzag order */
+    int offset;                 /* in the comp mcu line, mcu_offset */
+    int step;                   /* bytes from one mcu to the next */
 };
 
 struct s_jcomp {
@@ -217,18 +356,42 @@ struct s_jcomp {
     int qtbl_id;
     int ht_dc_id;
     int ht_ac_id;
+    int h_up;                    /* horizontal upsample factor */
+    int v_up;                    /* vertical upsample factor */
+    int width;                   /* comp pixels width */
+    int height;                  /* comp pixels height */
     int dc;
     int vec[DCTSIZE2];
-    u8 pixels[DCTSIZE2];
+    s16 *coef;                  /* progressive, quantized blocks in natural order */
+    int bw;                     /* blocks per line in coef */
+    int bh;                     /* block lines in coef */
+    u8 *pixels;                 /* ring of slots mcu lines */
+    int x0;                     /* comp column of pixels[0] */
+    int stride;
+    int lines;                  /* pixel rows in one mcu line */
+    int slots;                  /* mcu lines in pixels */
+};
+
+// bump allocator of everything one image needs, emptied when the next
+// starts. what does not fit goes to heap chunks, freed at the next reset,
+// which also grows an arena of our own to the total so that after the
+// largest image no decode mallocs. caller memory is used as is
+struct s_jarena {
+    u8 *base;
+    size_t cap;
+    size_t used;
+    size_t need;                /* bytes the image asked for, chunks too */
+    void *chunks;               /* overflow, first word links the next */
+    int caller;                 /* base from jd_set_arena */
 };
 
 struct s_jctx {
     int width;
     int height;
-    u8 *qtbl[2];
-    int htbl_count;
+    int err;                    /* JD_xxx of the image */
+    const struct s_qt_tbl *qtbl[4];     /* shared from the table cache, */
     int comp_count;
-    struct s_ht_tbl htbl[4];
+    const struct s_ht_tbl *htbl[4];     /* or in the arena once it is full */
     struct s_jcomp comp[3];
 
     int mcu_sizex;              /* mcu width */
@@ -236,16 +399,57 @@ struct s_jctx {
     int h_mcus;                 /* horizontal MCU count */
     int v_mcus;                 /* vertical MCU count */
     int mcu_blocks;             /* max mcu blocks */
+    u8 mcu_comp[MCU_MAX_BLOCKS];    /* comp of each block in mcu */
+    int mcu_offset[MCU_MAX_BLOCKS]; /* block offset in comp pixels */
+    struct s_mcu_blk mcu_blk[MCU_MAX_BLOCKS];   /* tables of the scan */
+    int out_x, out_y;           /* output window in the scaled image */
+    int out_w, out_h;
+    int mcu_x0, mcu_x1;         /* mcus decoded to pixels, the window and */
+    int mcu_y0, mcu_y1;         /* the mcus upsampling reads around it */
+    int bsize;                  /* block output size, DCTSIZE >> scale */
+    u8 zz_keep[DCTSIZE2];       /* zigzag coefs the idct reads */
+    void (*idct)(s32 *blk, u8 *out, int stride);
 
     int restintv;               /* rest interval */
     int restintv_next;          /* next */
     int restintv_cnt;           /* count */
+    int restintv_left;          /* markers left in the scan */
+
+    int progressive;            /* SOF2, scans fill coef, output at the end */
+    s16 *coef;                  /* all comps coef */
+    int eobrun;                 /* blocks left in EOB run */
 
     u8 *scan_out;               /* one line mcus */
     int scan_len;
-
-    u8 *pixels;
-    int pixels_len;
+    u8 *up_buf;                 /* upsampled chroma rows */
+
+    struct s_jinfo info;
+    u8 *pixels;                 /* caller output, or */
+    size_t pixels_len;
+    size_t out_len;
+    jd_row_cb row_cb;           /* caller sink of each mcu line */
+    void *row_user;
+    int planar;                 /* comps to the caller planes */
+    int xform;                  /* coefs only, for jd_transform */
+    struct s_jplanes planes;
+    u64 stage_ticks[JD_STAGES]; /* JD_BENCH timers of all threads */
+#ifdef JD_STATS
+    struct s_jstats stats;
+    struct timespec stats_t0;   /* decode start, scans are timed from */
+#endif
+
+    /* kept across images, nothing above survives _reset_jctx */
+    int threads;                /* decode one image in threads */
+    int scale;                  /* output 1 / (1 << scale) */
+    int crop_x, crop_y;         /* crop in the scaled image, none if w or h 0 */
+    int crop_w, crop_h;
+    int timing;                 /* JD_BENCH stage timers on */
+    int stream;                 /* tables carry over to the next image */
+    int ht_kept, qt_kept;       /* last defined in the stream, bit per id */
+    struct s_ht_key ht_keep[4];
+    struct s_qt_tbl qt_keep[4];
+    struct s_bctx b;
+    struct s_jarena arena;      /* tables, comp pixels, coefs, lines of the image */
 };
 
 static u8 _IZZ[64] = {
@@ -259,25 +463,53 @@ static u8 _IZZ[64] = {
     53, 60, 61, 54, 47, 55, 62, 63,
 };
 
-struct s_ht_ary
-_create_ht_ary(int count) {
-    struct s_ht_ary a = {0, NULL};
-    if (count > 0) {
-        a.count = count;
-        a.v = malloc(sizeof(*a.v) * count); /* free in destroy_jctx */
-        memset(a.v, 0, sizeof(*a.v) * count);
+static void*
+_arena_alloc(struct s_jarena *a, size_t size) {
+    void **chunk;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->need += size;
+    if (a->used + size <= a->cap) {
+        a->used += size;
+        return a->base + a->used - size;
     }
-    return a;
+    if (posix_memalign((void**)&chunk, ARENA_ALIGN, ARENA_ALIGN + size))
+        return NULL;
+    *chunk = a->chunks;
+    a->chunks = chunk;
+    return (u8*)chunk + ARENA_ALIGN;
 }
 
-void
-_destroy_ht_ary(struct s_ht_tbl *ht) {
-    int i;
-    for (i=0; i<VLC_MAX_LEN; i++) {
-        struct s_ht_ary *a = &ht->ary[i];
-        if (a->count > 0)
-            free(a->v);
+static void
+_arena_free_chunks(struct s_jarena *a) {
+    while ( a->chunks ) {
+        void *next = *(void**)a->chunks;
+        free(a->chunks);
+        a->chunks = next;
+    }
+}
+
+static void
+_arena_reset(struct s_jarena *a) {
+    _arena_free_chunks(a);
+    if (!a->caller && a->need > a->cap) {
+        free(a->base);
+        if (posix_memalign((void**)&a->base, ARENA_ALIGN, a->need))
+            a->base = NULL;
+        a->cap = a->base ? a->need : 0;
     }
+    // caller memory may start anywhere
+    a->used = -(uintptr_t)a->base & (ARENA_ALIGN - 1);
+    if (a->used > a->cap)
+        a->used = a->cap;
+    a->need = 0;
+}
+
+static void
+_arena_release(struct s_jarena *a) {
+    _arena_free_chunks(a);
+    if ( !a->caller )
+        free(a->base);
+    memset(a, 0, sizeof(*a));
 }
 
 struct s_jctx*
@@ -285,46 +517,120 @@ _create_jctx(void) {
     struct s_jctx *j = malloc(sizeof(*j));
     if ( j ) {
         memset(j, 0, sizeof(*j));
+        j->threads = 1;
     }
     return j;
 }
 
+// forget the last image, keep settings and buffers
+void
+_reset_jctx(struct s_jctx *j) {
+    memset(j, 0, offsetof(struct s_jctx, threads));
+    _arena_reset(&j->arena);
+}
+
 void
 _destroy_jctx(struct s_jctx *j) {
     if ( j ) {
-        int i;
-        for (i=0; i<4; i++)
-            _destroy_ht_ary( &j->htbl[i] );
-        free(j->scan_out);
-        free(j->pixels);
+        _arena_release(&j->arena);
         free(j);
     }
 }
 
-void
-_save_to_ppm(struct s_jctx *j) {
-    if ( j->scan_out ) {
-        FILE *fp = fopen("export.ppm", "wb");
-        assert(fp);
-        fprintf(fp, "P%d\n", j->mcu_blocks<=1 ? 5 : 6);
-        fprintf(fp, "%d %d\n255\n", j->width, j->height);
-        fwrite(j->pixels, 1, j->pixels_len, fp);
-        fclose(fp);
-        _log(D_INFO, "# Save to export.ppm ok #\n");
+// compiled huffman and quant tables shared by every handle and thread,
+// keyed by a hash of what the DHT or DQT defines. slots are filled once
+// and never emptied, so lookups take no lock. once half the slots are
+// used, tables new to the cache go to the arena of the image
+#define TCACHE_SLOTS 512
+
+struct s_tcache {
+    const void *slot[TCACHE_SLOTS];
+    int used;                   /* slots taken or reserved */
+};
+
+static struct s_tcache _ht_cache, _qt_cache;
+
+static u64
+_hash_bytes(u64 h, const void *p, size_t n) {
+    const u8 *c = p;
+    while ( n-- )
+        h = (h ^ *c++) * 0x100000001b3ull;     /* FNV-1a */
+    return h;
+}
+
+// the table matching key, built once into the cache or the arena
+static const void*
+_tcache_get(struct s_tcache *c, struct s_jarena *a, size_t size, u64 hash, const void *key,
+            int (*same)(const void *tbl, const void *key),
+            void (*build)(void *tbl, const void *key)) {
+    int i = hash & (TCACHE_SLOTS - 1), shared;
+    const void *p;
+    void *tbl = NULL;
+    for (; (p = __atomic_load_n(&c->slot[i], __ATOMIC_ACQUIRE)); i = (i + 1) & (TCACHE_SLOTS - 1)) {
+        if ( same(p, key) )
+            return p;
+    }
+    // a free slot is left for each reservation, the probe always ends
+    shared = __sync_fetch_and_add(&c->used, 1) < TCACHE_SLOTS / 2;
+    if (shared && posix_memalign(&tbl, ARENA_ALIGN, size))
+        tbl = NULL;
+    if ( !tbl ) {
+        __sync_fetch_and_sub(&c->used, 1);
+        shared = 0;
+        tbl = _arena_alloc(a, size);
+        if ( !tbl )
+            return NULL;
+    }
+    build(tbl, key);
+    if ( !shared )
+        return tbl;
+    for (;; i = (i + 1) & (TCACHE_SLOTS - 1)) {
+        p = NULL;
+        if (__atomic_compare_exchange_n(&c->slot[i], &p, tbl, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return tbl;
+        if ( same(p, key) ) {
+            free(tbl);          /* another thread built it first */
+            __sync_fetch_and_sub(&c->used, 1);
+            return p;
+        }
     }
 }
 
+static int
+_qt_same(const void *tbl, const void *key) {
+    const struct s_qt_tbl *t = tbl, *k = key;
+    return t->hash == k->hash && !memcmp(t->q, k->q, sizeof(t->q));
+}
+
+static void
+_qt_build(void *tbl, const void *key) {
+    memcpy(tbl, key, sizeof(struct s_qt_tbl));
+}
+
 void
 _get_qt_table(struct s_bctx *b, struct s_jctx *j) {
     u16 len = _next_word(b);
-    int s=_get_offset(b), e=s+len-2;
-    while (s < e) {
+    int i, s=_get_offset(b), e=s+len-2;
+    while (s < e && !_is_eof(b)) {
+        struct s_qt_tbl k;
         u8 buf = _next_byte(b);
         u8 precision = buf >> 4;
         u8 id = buf & 0xf;
-        j->qtbl[id] = _get_ptr(b);
+        for (i=0; i<DCTSIZE2; i++)
+            k.q[i] = precision ? _next_word(b) : _next_byte(b);
+        k.hash = _hash_bytes(0xcbf29ce484222325ull, k.q, sizeof(k.q));
+        if ( j->stream ) {
+            j->qt_keep[id & 3] = k;
+            j->qt_kept |= 1 << (id & 3);
+        }
+        j->qtbl[id & 3] = _tcache_get(&_qt_cache, &j->arena, sizeof(k), k.hash, &k,
+                                      _qt_same, _qt_build);
+        if ( !j->qtbl[id & 3] ) {
+            j->err = JD_ENOMEM;
+            _set_eof(b);
+            return;
+        }
         _log(D_MARKER, "DQT precision:%d id:%d\n", precision, id);
-        _skip_bytes(b, 64);
         s = _get_offset(b);
     }
 }
@@ -348,53 +654,225 @@ _print_binary(int x, int len) {
 void
 _print_ht_table(struct s_jctx *j, int idx) {
     int i, n;
-    struct s_ht_tbl *h = &j->htbl[idx];
+    const struct s_ht_tbl *h = j->htbl[idx];
     printf("## ht table vlc[%d] count %d\n", idx, h->count);
     for (n=0; n<VLC_MAX_LEN; n++) {
-        struct s_ht_ary *a = &h->ary[n];
+        const struct s_ht_ary *a = &h->ary[n];
         //printf("vlc len %d, count %d\n", n+1, a->count);
         for (i=0; i<a->count; i++) {
-            struct s_ht_vlc *v = &a->v[i];
+            const struct s_ht_vlc *v = &a->v[i];
             printf("\tvlc:%-3d %02x, %s\n", n+1, v->code, _print_binary(v->val, n+1));
         }
     }
 }
 
+int
+_vlc_extend(int val, int n) {
+    if (val < (1<<(n-1))) { val += (int)(~(1<<n)) + 2; }
+    return val;
+}
+
+// lookahead table resolves vlc len and code for vlc <= VLC_LOOKAHEAD bits,
+// and the extended value too when the extra bits also fit in
+void
+_build_ht_lut(struct s_ht_tbl *ht) {
+    int n, i, k, vlc = 0, idx = 0;
+    memset(ht->look, 0, sizeof(ht->look));
+    memset(ht->fast, 0, sizeof(ht->fast));
+    for (n=1; n<=VLC_MAX_LEN; n++) {
+        struct s_ht_ary *a = &ht->ary[n-1];
+        ht->valptr[n] = idx - vlc;
+        for (i=0; i<a->count; i++, vlc++, idx++) {
+            u8 code = a->v[i].code;
+            int shift = VLC_LOOKAHEAD - n;
+            int extra = code & 0xf;
+            ht->huffval[idx] = code;
+            if (n > VLC_LOOKAHEAD)
+                continue;
+            for (k=vlc<<shift; k<(vlc+1)<<shift; k++) {
+                ht->look[k] = (n << 8) | code;
+                if (n + extra <= VLC_LOOKAHEAD) {
+                    int val = 0;
+                    if ( extra ) {
+                        val = (k >> (shift - extra)) & ((1<<extra) - 1);
+                        val = _vlc_extend(val, extra);
+                    }
+                    ht->fast[k] = (s32)((u32)val << 16) | (code << 8) | (n + extra);
+                }
+            }
+        }
+        ht->maxcode[n] = a->count ? (vlc - 1) : -1;
+        vlc <<= 1;
+    }
+}
+
+// Annex K.3, luma and chroma, counts of each code length then symbols
+static const u8 _STD_DC_BITS[2][16] = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+static const u8 _STD_DC_VALS[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const u8 _STD_AC_BITS[2][16] = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+static const u8 _STD_AC_VALS[2][162] = {
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+    },
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+    },
+};
+
+static void
+_ht_key_hash(struct s_ht_key *k) {
+    k->hash = _hash_bytes(_hash_bytes(0xcbf29ce484222325ull, k->bits, sizeof(k->bits)),
+                          k->vals, k->count);
+}
+
+// Annex K table of htbl index idx, DC then AC, luma then chroma
+static void
+_ht_std_key(int idx, struct s_ht_key *k) {
+    const u8 *vals = idx < 2 ? _STD_DC_VALS : _STD_AC_VALS[idx & 1];
+    int i;
+    memcpy(k->bits, idx < 2 ? _STD_DC_BITS[idx & 1] : _STD_AC_BITS[idx & 1], sizeof(k->bits));
+    for (i=0, k->count=0; i<VLC_MAX_LEN; i++)
+        k->count += k->bits[i];
+    memcpy(k->vals, vals, k->count);
+    _ht_key_hash(k);
+}
+
+static int
+_ht_same(const void *tbl, const void *key) {
+    const struct s_ht_tbl *t = tbl;
+    const struct s_ht_key *k = key;
+    int n;
+    if (t->hash != k->hash || t->count != k->count)
+        return 0;
+    for (n=0; n<VLC_MAX_LEN && t->ary[n].count == k->bits[n]; n++);
+    return n == VLC_MAX_LEN && !memcmp(t->huffval, k->vals, k->count);
+}
+
+static void
+_ht_build(void *tbl, const void *key) {
+    struct s_ht_tbl *ht = tbl;
+    const struct s_ht_key *k = key;
+    int i, w, ht_base, idx = 0;
+    ht->count = k->count;
+    ht->hash = k->hash;
+    for (w=0, ht_base=0; w<VLC_MAX_LEN; w++) {
+        struct s_ht_ary *a = &ht->ary[w];
+        a->count = k->bits[w];
+        a->v = &ht->vlc[idx];
+        for (i=0; i<a->count; i++) {
+            struct s_ht_vlc *v  = &a->v[i];
+            v->code = k->vals[idx++];
+            v->val = ht_base;
+            //_log(D_VERBOSE, "ht %2d, %s\n", w+1, _print_binary(ht_base, w+1));
+            ht_base++;
+        }
+        ht_base <<= 1;
+    }
+    _build_ht_lut(ht);
+}
+
 void
 _get_ht_table(struct s_bctx *b, struct s_jctx *j) {
-    int i, w, ht_base;
+    int i;
     u16 len=_next_word(b);
     u32 start=_get_offset(b), end=start+len-2;
-    while (start < end) {
+    while (start < end && !_is_eof(b)) {
+        struct s_ht_key k;
         u8 buf = _next_byte(b);
         u8 typ_n_id = (buf>>3)|(buf&0xf); /* combine them */
-        struct s_ht_tbl *ht = &j->htbl[typ_n_id];
+        int avail = 2;          /* vlc left of this length */
+        k.count = 0;
         for (i=0; i<VLC_MAX_LEN; i++) {
-            int vlc_count = _next_byte(b);
-            ht->count += vlc_count;
-            ht->ary[i] = _create_ht_ary( vlc_count );
-        }
-        for (w=0, ht_base=0; w<VLC_MAX_LEN; w++) {
-            struct s_ht_ary *a = &ht->ary[w];
-            for (i=0; i<a->count; i++) {
-                struct s_ht_vlc *v  = &a->v[i];
-                v->code = _next_byte(b);
-                v->val = ht_base;
-                //_log(D_VERBOSE, "ht %2d, %s\n", w+1, _print_binary(ht_base, w+1));
-                ht_base++;
-            }
-            if (a->count < (w+1)*(w+1))
-                ht_base <<= 1;
+            k.bits[i] = _next_byte(b);
+            avail -= k.bits[i];
+            if (avail < 0 || k.count + k.bits[i] > 256)
+                break;
+            k.count += k.bits[i];
+            avail <<= 1;
+        }
+        if (i < VLC_MAX_LEN) {
+            _log(D_ERROR, "# Bad vlc counts in huffman table ! #\n");
+            j->err = JD_ERROR;
+            _set_eof(b);
+            return;
+        }
+        for (i=0; i<k.count; i++)
+            k.vals[i] = _next_byte(b);
+        _ht_key_hash(&k);
+        if ( j->stream ) {
+            j->ht_keep[typ_n_id & 3] = k;
+            j->ht_kept |= 1 << (typ_n_id & 3);
+        }
+        j->htbl[typ_n_id & 3] = _tcache_get(&_ht_cache, &j->arena, sizeof(struct s_ht_tbl),
+                                            k.hash, &k, _ht_same, _ht_build);
+        if ( !j->htbl[typ_n_id & 3] ) {
+            j->err = JD_ENOMEM;
+            _set_eof(b);
+            return;
         }
-        j->htbl_count++;
         start = _get_offset(b);
-        _log(D_MARKER, "DHT type_n_id %d, count %d\n", typ_n_id, ht->count);
+        _log(D_MARKER, "DHT type_n_id %d, count %d\n", typ_n_id, k.count);
+    }
+}
+
+// tables the image does not define: the last ones earlier frames of a
+// stream defined, then for huffman the Annex K ones, as MJPEG expects.
+// 0 out of memory
+static int
+_fill_tables(struct s_jctx *j) {
+    int i;
+    for (i=0; i<4; i++) {
+        if (!j->qtbl[i] && (j->qt_kept & (1 << i))) {
+            j->qtbl[i] = _tcache_get(&_qt_cache, &j->arena, sizeof(struct s_qt_tbl),
+                                     j->qt_keep[i].hash, &j->qt_keep[i], _qt_same, _qt_build);
+            if ( !j->qtbl[i] )
+                return 0;
+        }
+        if ( !j->htbl[i] ) {
+            struct s_ht_key std;
+            const struct s_ht_key *k = &j->ht_keep[i];
+            if ( !(j->ht_kept & (1 << i)) ) {
+                _ht_std_key(i, &std);
+                k = &std;
+            }
+            j->htbl[i] = _tcache_get(&_ht_cache, &j->arena, sizeof(struct s_ht_tbl),
+                                     k->hash, k, _ht_same, _ht_build);
+            if ( !j->htbl[i] )
+                return 0;
+        }
     }
+    return 1;
 }
 
 void
 _decode_frame(struct s_bctx *b, struct s_jctx *j) {
-    int i, hmax=0, vmax=0;
+    int i, hmax=0, vmax=0, scale;
     u16 len = _next_word(b);
     u8 P = _next_byte(b);
     j->height = _next_word(b);
@@ -402,6 +880,10 @@ _decode_frame(struct s_bctx *b, struct s_jctx *j) {
     j->comp_count = _next_byte(b);
     _log(D_MARKER, "Baseline DCT %d, precision %d, %dx%d, comp %d\n",
            len, P, j->width, j->height, j->comp_count);
+    if ((j->comp_count != 1 && j->comp_count != 3) || !j->width || !j->height) {
+        _log(D_ERROR, "# Unsupported frame ! #\n");
+        goto fail;
+    }
     for(i=0; i<j->comp_count; i++) {
         u8 buf;
         struct s_jcomp *c = &j->comp[i];
@@ -409,35 +891,136 @@ _decode_frame(struct s_bctx *b, struct s_jctx *j) {
         buf = _next_byte(b);
         c->h_samp = buf >> 4;
         c->v_samp = buf & 0xf;
-        c->qtbl_id = _next_byte(b);
-        assert((c->h_samp & (c->h_samp - 1)) == 0); /* NOP */
-        assert((c->v_samp & (c->v_samp - 1)) == 0); /* NOP */
+        c->qtbl_id = _next_byte(b) & 3;
         if (hmax < c->h_samp) hmax = c->h_samp;
         if (vmax < c->v_samp) vmax = c->v_samp;
         //
         _log(D_COEFF, "\tcomp %d, h:v %d:%d, qtbl_id:%d\n", c->id, c->h_samp, c->v_samp, c->qtbl_id);
-        if ((c->h_samp!=1) || (c->v_samp!=1)) {
+        if ((c->h_samp<1) || (c->h_samp>2) || (c->v_samp<1) || (c->v_samp>2)) {
             _log(D_ERROR, "# Unsupported horizontal & vertical sample factor ! #\n");
-            _set_eof(b);
-            return;
+            goto fail;
         }
     }
-    j->mcu_sizex = hmax << 3;
-    j->mcu_sizey = vmax << 3;
-    j->h_mcus = (j->width + j->mcu_sizex - 1) / j->mcu_sizex;
-    j->v_mcus = (j->height + j->mcu_sizey - 1) / j->mcu_sizey;
-    {
-        struct s_jcomp *c = &j->comp[0];
-        j->mcu_blocks = c->h_samp * c->v_samp + j->comp_count - 1;
-
-        j->scan_len =  j->width * j->mcu_sizey * j->comp_count;
-        j->scan_out = (u8*)malloc( j->scan_len );
-
-        j->pixels_len = j->width * j->height * j->comp_count;
-        j->pixels = (u8*)malloc( j->pixels_len );
+    if (j->comp_count == 1) {
+        // non-interleaved, mcu is one block whatever the factors
+        j->comp[0].h_samp = j->comp[0].v_samp = hmax = vmax = 1;
+    }
+    else if ((j->comp[0].h_samp != hmax) || (j->comp[0].v_samp != vmax)) {
+        _log(D_ERROR, "# Unsupported chroma sample factor above luma ! #\n");
+        goto fail;
+    }
+    j->h_mcus = (j->width + (hmax << 3) - 1) / (hmax << 3);
+    j->v_mcus = (j->height + (vmax << 3) - 1) / (vmax << 3);
+
+    // scaled output, each block gives bsize x bsize pixels
+    scale = j->xform ? 0 : j->scale;
+    j->bsize = DCTSIZE >> scale;
+    j->width = (j->width + (1 << scale) - 1) >> scale;
+    j->height = (j->height + (1 << scale) - 1) >> scale;
+    j->mcu_sizex = hmax * j->bsize;
+    j->mcu_sizey = vmax * j->bsize;
+    for (i=0; i<DCTSIZE2; i++)
+        j->zz_keep[i] = (_IZZ[i] & 7) < j->bsize && (_IZZ[i] >> 3) < j->bsize;
+
+    // output window, the whole image unless cropped
+    j->out_x = j->out_y = 0;
+    j->out_w = j->width;
+    j->out_h = j->height;
+    if (j->crop_w > 0 && j->crop_h > 0 && !j->xform) {
+        int x1 = j->crop_x + j->crop_w, y1 = j->crop_y + j->crop_h;
+        j->out_x = j->crop_x > 0 ? j->crop_x : 0;
+        j->out_y = j->crop_y > 0 ? j->crop_y : 0;
+        j->out_w = (x1 < j->width ? x1 : j->width) - j->out_x;
+        j->out_h = (y1 < j->height ? y1 : j->height) - j->out_y;
+        if (j->out_w <= 0 || j->out_h <= 0) {
+            _log(D_ERROR, "# Crop outside the image ! #\n");
+            goto fail;
+        }
+    }
+    j->mcu_x0 = j->out_x / j->mcu_sizex - (hmax > 1);
+    j->mcu_x1 = (j->out_x + j->out_w - 1) / j->mcu_sizex + 1 + (hmax > 1);
+    j->mcu_y0 = j->out_y / j->mcu_sizey - (vmax > 1);
+    j->mcu_y1 = (j->out_y + j->out_h - 1) / j->mcu_sizey + 1 + (vmax > 1);
+    if (j->mcu_x0 < 0) j->mcu_x0 = 0;
+    if (j->mcu_y0 < 0) j->mcu_y0 = 0;
+    if (j->mcu_x1 > j->h_mcus) j->mcu_x1 = j->h_mcus;
+    if (j->mcu_y1 > j->v_mcus) j->mcu_y1 = j->v_mcus;
+
+    j->info.width = j->out_w;
+    j->info.height = j->out_h;
+    j->info.comps = j->comp_count;
+    j->info.progressive = j->progressive;
+    for (i=0; i<j->comp_count; i++) {
+        int h_up = hmax / j->comp[i].h_samp, v_up = vmax / j->comp[i].v_samp;
+        j->info.plane_w[i] = (j->out_x + j->out_w + h_up - 1) / h_up - j->out_x / h_up;
+        j->info.plane_h[i] = (j->out_y + j->out_h + v_up - 1) / v_up - j->out_y / v_up;
     }
+    j->pixels_len = (size_t)j->out_w * j->out_h * j->comp_count;
+    if (!j->xform && (j->planar ? !j->planes.plane[0] : !j->row_cb && j->out_len < j->pixels_len)) {
+        j->err = JD_ESIZE;
+        _set_eof(b);
+        return;
+    }
+    j->mcu_blocks = 0;
+    for (i=0; i<j->comp_count; i++) {
+        int bx, by;
+        struct s_jcomp *c = &j->comp[i];
+        c->h_up = hmax / c->h_samp;
+        c->v_up = vmax / c->v_samp;
+        c->width = (j->width * c->h_samp + hmax - 1) / hmax;
+        c->height = (j->height * c->v_samp + vmax - 1) / vmax;
+        c->x0 = j->mcu_x0 * c->h_samp * j->bsize;
+        c->stride = (j->mcu_x1 - j->mcu_x0) * c->h_samp * j->bsize;
+        c->lines = c->v_samp * j->bsize;
+        c->slots = MCU_LINE_SLOTS;
+        c->pixels = (u8*)_arena_alloc( &j->arena, c->stride * c->lines * c->slots );
+        if ( !c->pixels ) goto nomem;
+        // blocks of one comp are left to right, top to bottom in mcu
+        for (by=0; by<c->v_samp; by++) {
+            for (bx=0; bx<c->h_samp; bx++) {
+                if (j->mcu_blocks >= MCU_MAX_BLOCKS) {
+                    _log(D_ERROR, "# Too many blocks in mcu ! #\n");
+                    goto fail;
+                }
+                j->mcu_comp[j->mcu_blocks] = i;
+                j->mcu_offset[j->mcu_blocks] = by * j->bsize * c->stride + bx * j->bsize;
+                j->mcu_blocks++;
+            }
+        }
+    }
+    if (j->progressive || j->xform) {
+        // whole image quantized coef, 128 bytes a block of the mcu grid
+        int blocks = 0;
+        for (i=0; i<j->comp_count; i++) {
+            struct s_jcomp *c = &j->comp[i];
+            c->bw = j->h_mcus * c->h_samp;
+            c->bh = j->v_mcus * c->v_samp;
+            blocks += c->bw * c->bh;
+        }
+        j->coef = (s16*)_arena_alloc( &j->arena, blocks * DCTSIZE2 * sizeof(s16) );
+        if ( !j->coef ) goto nomem;
+        memset(j->coef, 0, blocks * DCTSIZE2 * sizeof(s16));
+        for (i=0, blocks=0; i<j->comp_count; i++) {
+            struct s_jcomp *c = &j->comp[i];
+            c->coef = &j->coef[blocks * DCTSIZE2];
+            blocks += c->bw * c->bh;
+        }
+        _log(D_COEFF, "\tcoef %d blocks, %d bytes\n", blocks, blocks * DCTSIZE2 * (int)sizeof(s16));
+    }
+    j->scan_len =  j->out_w * j->mcu_sizey * j->comp_count;
+    j->scan_out = (u8*)_arena_alloc( &j->arena, j->scan_len + j->out_w * 2 );
+    if ( !j->scan_out ) goto nomem;
+    j->up_buf = j->scan_out + j->scan_len;
     _log(D_COEFF, "\tmcu, sx:%d sy:%d h:%d v:%d blocks:%d\n",
          j->mcu_sizex, j->mcu_sizey, j->h_mcus, j->v_mcus, j->mcu_blocks);
+    return;
+nomem:
+    j->err = JD_ENOMEM;
+    _set_eof(b);
+    return;
+fail:
+    j->err = JD_ERROR;
+    _set_eof(b);
 }
 
 // from nanojpeg.c
@@ -549,176 +1132,1695 @@ _idct_col(const s32* blk, u8 *out, int stride) {
 }
 // end of idct
 
+// the idct kernels leave blk as it is, the decoder clears what it wrote
 void
-_h1v1_convert_mcu(struct s_jctx *j, int mcu_n) {
-    int x, y, obase, pbase;
-    u8 *out = j->scan_out;
-    u8 *py = j->comp[0].pixels;
-    u8 *pcb = j->comp[1].pixels;
-    u8 *pcr = j->comp[2].pixels;
-    pbase = 0;
-    obase = mcu_n * j->mcu_sizex * 3;
-    for (y=0; y<j->mcu_sizey; y++) {
-        for (x=0; x<j->mcu_sizex; x++) {
-            register s32 y = py[pbase+x] << 8;
-            register s32 cb = pcb[pbase+x] - 128;
-            register s32 cr = pcr[pbase+x] - 128;
-            out[obase+x*3  ] = _truncate((y +            359 * cr + 128) >> 8);
-            out[obase+x*3+1] = _truncate((y -  88 * cb - 183 * cr + 128) >> 8);
-            out[obase+x*3+2] = _truncate((y + 454 * cb            + 128) >> 8);            
-        }
-        pbase += DCTSIZE;
-        obase += j->width * 3;
-    }
-    //_dump_buf(out, j->width*3);
+_idct_8x8_c(s32 *blk, u8 *out, int stride) {
+    int i;
+    s32 ws[DCTSIZE2];
+    memcpy(ws, blk, sizeof(ws));
+    for (i=0; i<DCTSIZE2; i+=DCTSIZE)
+        _idct_row( &ws[i] );
+    for (i=0; i<DCTSIZE; i++)
+        _idct_col( &ws[i], &out[i], stride );
 }
 
+// blocks whose coefs are all in the top left 4x4, zigzag index 9 at most.
+// _idct_row/_idct_col with the terms of coefs 4..7 dropped, rows 4..7 are
+// zero and skip the row pass, so the output is the same
+#define ZZ_LOW_LAST 9
+
 void
-_grayscale_convert_mcu(struct s_jctx *j, int mcu_n) {
-    int y, obase, pbase;
-    u8 *out = j->scan_out;
-    u8 *py = j->comp[0].pixels;
-    pbase = 0;
-    obase = mcu_n * j->mcu_sizex;
-    for (y=0; y<j->mcu_sizey; y++) {
-        memcpy(&out[obase], &py[pbase], DCTSIZE);
-        pbase += DCTSIZE;
-        obase += j->width;
+_idct_row_low(s32 *blk) {
+    s32 x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    if (!((x3 = blk[2]) | (x4 = blk[1]) | (x7 = blk[3]))) {
+        blk[0] = blk[1] = blk[2] = blk[3] = blk[4] = blk[5] = blk[6] = blk[7] = blk[0] << 3;
+        return;
     }
+    x0 = (blk[0] << 11) + 128;
+    x5 = W7 * x4;
+    x4 = W1 * x4;
+    x6 = W3 * x7;
+    x7 = -W5 * x7;
+    x8 = x0;
+    x2 = W6 * x3;
+    x3 = W2 * x3;
+    x1 = x4 + x6;
+    x4 -= x6;
+    x6 = x5 + x7;
+    x5 -= x7;
+    x7 = x8 + x3;
+    x8 -= x3;
+    x3 = x0 + x2;
+    x0 -= x2;
+    x2 = (181 * (x4 + x5) + 128) >> 8;
+    x4 = (181 * (x4 - x5) + 128) >> 8;
+    blk[0] = (x7 + x1) >> 8;
+    blk[1] = (x3 + x2) >> 8;
+    blk[2] = (x0 + x4) >> 8;
+    blk[3] = (x8 + x6) >> 8;
+    blk[4] = (x8 - x6) >> 8;
+    blk[5] = (x0 - x4) >> 8;
+    blk[6] = (x3 - x2) >> 8;
+    blk[7] = (x7 - x1) >> 8;
 }
 
-int
-_check_vlc_in_ht(struct s_bctx *b, struct s_ht_tbl *ht, u8 *code) {
-    int i, n, val;
-    struct s_ht_ary *a = NULL;
-    for (n=1; n<=VLC_MAX_LEN; n++) {
-        val = _bits_try(b, n);
-        a = &ht->ary[n-1];
-        assert(a);
-        for (i=0; i<a->count; i++) {
-            struct s_ht_vlc *v = &a->v[i];
-            if (val == v->val) {
-                _log(D_VERBOSE, "src:%x code:%x bits:%d\n", val<<(16-n) , v->code, n);
-                _bits_skip(b, n);
-                if ( code ) { *code = (u8)v->code; }
-                n = v->code & 0xf;
-                if ( !n ) { _log(D_VERBOSE, "-- bits 0\n"); return 0; }
-                val = _bits_read(b, n);
-                if (val < (1<<(n-1))) { val += (int)(~(1<<n)) + 2; }
-                _log(D_VERBOSE, "decode val:%x, bits %d\n", val&0xff, n);
-                return val;
-            }
+void
+_idct_col_low(const s32* blk, u8 *out, int stride) {
+    s32 x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    if (!((x3 = blk[8*2]) | (x4 = blk[8*1]) | (x7 = blk[8*3]))) {
+        x1 = _truncate(((blk[0] + 32) >> 6) + 128);
+        for (x0 = 8;  x0;  --x0) {
+            *out = (u8) x1;
+            out += stride;
         }
+        return;
     }
-    _log(D_ERROR, "# Fail to decode huff at %d, val %s #\n", _get_offset(b), _print_binary(val, 16));
-    _dump_buf(_get_ptr(b), DCTSIZE);
-    assert(0);
-    return 0;
+    x0 = (blk[0] << 8) + 8192;
+    x8 = W7 * x4 + 4;
+    x4 = (x8 + (W1 - W7) * x4) >> 3;
+    x5 = x8 >> 3;
+    x8 = W3 * x7 + 4;
+    x6 = x8 >> 3;
+    x7 = (x8 - (W3 + W5) * x7) >> 3;
+    x8 = x0;
+    x1 = W6 * x3 + 4;
+    x2 = x1 >> 3;
+    x3 = (x1 + (W2 - W6) * x3) >> 3;
+    x1 = x4 + x6;
+    x4 -= x6;
+    x6 = x5 + x7;
+    x5 -= x7;
+    x7 = x8 + x3;
+    x8 -= x3;
+    x3 = x0 + x2;
+    x0 -= x2;
+    x2 = (181 * (x4 + x5) + 128) >> 8;
+    x4 = (181 * (x4 - x5) + 128) >> 8;
+    *out = _truncate(((x7 + x1) >> 14) + 128);  out += stride;
+    *out = _truncate(((x3 + x2) >> 14) + 128);  out += stride;
+    *out = _truncate(((x0 + x4) >> 14) + 128);  out += stride;
+    *out = _truncate(((x8 + x6) >> 14) + 128);  out += stride;
+    *out = _truncate(((x8 - x6) >> 14) + 128);  out += stride;
+    *out = _truncate(((x0 - x4) >> 14) + 128);  out += stride;
+    *out = _truncate(((x3 - x2) >> 14) + 128);  out += stride;
+    *out = _truncate(((x7 - x1) >> 14) + 128);
 }
 
-// get DC/AC and de-quant, invert zig-zag
-static void
-_decode_block(struct s_bctx *b, struct s_jctx *j, int comp_id) {
-    int i, ai, val;
-    struct s_ht_tbl *htbl = NULL;
-    struct s_jcomp *c = &j->comp[comp_id];
-    const u8 *qtbl = j->qtbl[c->qtbl_id];
-    assert( qtbl );
-
-    _log(D_VERBOSE, "decode comp %d, qtbl_id:%d ht_dc:%d ht_ac:%d\n",
-         comp_id, c->qtbl_id, c->ht_dc_id, c->ht_ac_id);
+void
+_idct_8x8_low_c(s32 *blk, u8 *out, int stride) {
+    int i;
+    s32 ws[DCTSIZE2/2];
+    memcpy(ws, blk, sizeof(ws));
+    for (i=0; i<DCTSIZE2/2; i+=DCTSIZE)
+        _idct_row_low( &ws[i] );
+    for (i=0; i<DCTSIZE; i++)
+        _idct_col_low( &ws[i], &out[i], stride );
+}
 
-    memset(c->vec, 0, DCTSIZE2*sizeof(c->vec[0]));
+// reduced idct for scaled output, from the low NxN coefs only (libjpeg
+// jidctint.c 4x4 and 2x2). dc scaling matches _idct_8x8, (dc + 4) >> 3
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_1_847759065 15137
 
-    // get DC
-    htbl = &j->htbl[c->ht_dc_id];
-    assert(htbl);
-    val = _check_vlc_in_ht(b, htbl, NULL);
-    c->dc += val;
-    c->vec[0] = c->dc * qtbl[0];
-    //_log(D_VERBOSE, "DC %d\n", c->dc);
-    
-    // get AC
-    htbl = &j->htbl[c->ht_ac_id];
-    assert(htbl);
-    for (ai=1; ai<64; ai++) {
-        u8 code = 0;
-        val = _check_vlc_in_ht(b, htbl, &code);
-        if ( !code ) { _log(D_VERBOSE, "-- EOB\n"); break; }    /* EOB */
-        else {
-            ai += (code >> 4);
-            c->vec[(s32) _IZZ[ai] ] = val * qtbl[ai]; /* dequant */
-        }
+void
+_idct_4x4(s32 *blk, u8 *out, int stride) {
+    int i;
+    s32 ws[16];
+    for (i=0; i<4; i++) {
+        const s32 *in = &blk[i];
+        s32 t10 = (in[0] + in[16]) * 4;
+        s32 t12 = (in[0] - in[16]) * 4;
+        s32 z1 = (in[8] + in[24]) * FIX_0_541196100 + (1 << 10);
+        s32 t0 = (z1 + in[8] * FIX_0_765366865) >> 11;
+        s32 t2 = (z1 - in[24] * FIX_1_847759065) >> 11;
+        ws[i] = t10 + t0;
+        ws[12+i] = t10 - t0;
+        ws[4+i] = t12 + t2;
+        ws[8+i] = t12 - t2;
     }
+    for (i=0; i<4; i++, out+=stride) {
+        const s32 *in = &ws[i*4];
+        s32 t10 = (in[0] + 16 + in[2]) * (1 << 13);
+        s32 t12 = (in[0] + 16 - in[2]) * (1 << 13);
+        s32 z1 = (in[1] + in[3]) * FIX_0_541196100;
+        s32 t0 = z1 + in[1] * FIX_0_765366865;
+        s32 t2 = z1 - in[3] * FIX_1_847759065;
+        out[0] = _truncate(((t10 + t0) >> 18) + 128);
+        out[3] = _truncate(((t10 - t0) >> 18) + 128);
+        out[1] = _truncate(((t12 + t2) >> 18) + 128);
+        out[2] = _truncate(((t12 - t2) >> 18) + 128);
+    }
+}
 
-    //_dump_buf((u8*)c->vec);
-    
+void
+_idct_2x2(s32 *blk, u8 *out, int stride) {
+    s32 t0 = blk[0] + 4 + blk[8];
+    s32 t2 = blk[0] + 4 - blk[8];
+    s32 t1 = blk[1] + blk[9];
+    s32 t3 = blk[1] - blk[9];
+    out[0] = _truncate(((t0 + t1) >> 3) + 128);
+    out[1] = _truncate(((t0 - t1) >> 3) + 128);
+    out += stride;
+    out[0] = _truncate(((t2 + t3) >> 3) + 128);
+    out[1] = _truncate(((t2 - t3) >> 3) + 128);
+}
+
+void
+_idct_1x1(s32 *blk, u8 *out, int stride) {
+    out[0] = _truncate(((blk[0] + 4) >> 3) + 128);
+}
+
+#ifdef JD_X86
+// same integer steps as _idct_row/_idct_col on s32 lanes, one 1-D pass
+// for 8 (avx2) or 4 (sse2) vectors at once, so output is bit-exact; the
+// zero-AC shortcuts of the scalar version give the same result as the
+// full transform, so no branch is needed. row pass: shl 11, bias 128,
+// no rounding, out >> 8; column pass: shl 8, bias 8192, round 4 >> 3,
+// out >> 14
+#define IDCT_ROW_PASS 11, 128, 0, 0, 8
+#define IDCT_COL_PASS 8, 8192, 4, 3, 14
+
+static inline __attribute__((target("avx2"))) void
+_idct_1d_avx2(__m256i *v, int sl, int bias, int rnd, int sh, int fs) {
+    __m256i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    const __m128i csl = _mm_cvtsi32_si128(sl);
+    const __m128i csh = _mm_cvtsi32_si128(sh);
+    const __m128i cfs = _mm_cvtsi32_si128(fs);
+    const __m256i crnd = _mm256_set1_epi32(rnd);
+#define MULC(a, k) _mm256_mullo_epi32((a), _mm256_set1_epi32(k))
+    x1 = _mm256_sll_epi32(v[4], csl);
+    x2 = v[6]; x3 = v[2]; x4 = v[1]; x5 = v[7]; x6 = v[5]; x7 = v[3];
+    x0 = _mm256_add_epi32(_mm256_sll_epi32(v[0], csl), _mm256_set1_epi32(bias));
+    x8 = _mm256_add_epi32(MULC(_mm256_add_epi32(x4, x5), W7), crnd);
+    x4 = _mm256_sra_epi32(_mm256_add_epi32(x8, MULC(x4, W1 - W7)), csh);
+    x5 = _mm256_sra_epi32(_mm256_sub_epi32(x8, MULC(x5, W1 + W7)), csh);
+    x8 = _mm256_add_epi32(MULC(_mm256_add_epi32(x6, x7), W3), crnd);
+    x6 = _mm256_sra_epi32(_mm256_sub_epi32(x8, MULC(x6, W3 - W5)), csh);
+    x7 = _mm256_sra_epi32(_mm256_sub_epi32(x8, MULC(x7, W3 + W5)), csh);
+    x8 = _mm256_add_epi32(x0, x1);
+    x0 = _mm256_sub_epi32(x0, x1);
+    x1 = _mm256_add_epi32(MULC(_mm256_add_epi32(x3, x2), W6), crnd);
+    x2 = _mm256_sra_epi32(_mm256_sub_epi32(x1, MULC(x2, W2 + W6)), csh);
+    x3 = _mm256_sra_epi32(_mm256_add_epi32(x1, MULC(x3, W2 - W6)), csh);
+    x1 = _mm256_add_epi32(x4, x6);
+    x4 = _mm256_sub_epi32(x4, x6);
+    x6 = _mm256_add_epi32(x5, x7);
+    x5 = _mm256_sub_epi32(x5, x7);
+    x7 = _mm256_add_epi32(x8, x3);
+    x8 = _mm256_sub_epi32(x8, x3);
+    x3 = _mm256_add_epi32(x0, x2);
+    x0 = _mm256_sub_epi32(x0, x2);
+    x2 = _mm256_srai_epi32(_mm256_add_epi32(MULC(_mm256_add_epi32(x4, x5), 181), _mm256_set1_epi32(128)), 8);
+    x4 = _mm256_srai_epi32(_mm256_add_epi32(MULC(_mm256_sub_epi32(x4, x5), 181), _mm256_set1_epi32(128)), 8);
+#undef MULC
+    v[0] = _mm256_sra_epi32(_mm256_add_epi32(x7, x1), cfs);
+    v[1] = _mm256_sra_epi32(_mm256_add_epi32(x3, x2), cfs);
+    v[2] = _mm256_sra_epi32(_mm256_add_epi32(x0, x4), cfs);
+    v[3] = _mm256_sra_epi32(_mm256_add_epi32(x8, x6), cfs);
+    v[4] = _mm256_sra_epi32(_mm256_sub_epi32(x8, x6), cfs);
+    v[5] = _mm256_sra_epi32(_mm256_sub_epi32(x0, x4), cfs);
+    v[6] = _mm256_sra_epi32(_mm256_sub_epi32(x3, x2), cfs);
+    v[7] = _mm256_sra_epi32(_mm256_sub_epi32(x7, x1), cfs);
+}
+
+static inline __attribute__((target("avx2"))) void
+_transpose_8x8_avx2(__m256i *r) {
+    __m256i t0, t1, t2, t3, t4, t5, t6, t7;
+    __m256i u0, u1, u2, u3, u4, u5, u6, u7;
+    t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    u0 = _mm256_unpacklo_epi64(t0, t2);
+    u1 = _mm256_unpackhi_epi64(t0, t2);
+    u2 = _mm256_unpacklo_epi64(t1, t3);
+    u3 = _mm256_unpackhi_epi64(t1, t3);
+    u4 = _mm256_unpacklo_epi64(t4, t6);
+    u5 = _mm256_unpackhi_epi64(t4, t6);
+    u6 = _mm256_unpacklo_epi64(t5, t7);
+    u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+static __attribute__((target("avx2"))) void
+_idct_8x8_avx2(s32 *blk, u8 *out, int stride) {
+    int i;
+    __m256i v[8];
+    const __m256i bias = _mm256_set1_epi32(128);
+    for (i=0; i<8; i++)
+        v[i] = _mm256_loadu_si256((const __m256i*)&blk[i*DCTSIZE]);
+    _transpose_8x8_avx2(v);     /* lane = row */
+    _idct_1d_avx2(v, IDCT_ROW_PASS);
+    _transpose_8x8_avx2(v);     /* lane = column */
+    _idct_1d_avx2(v, IDCT_COL_PASS);
+    for (i=0; i<8; i++) {
+        __m256i x = _mm256_add_epi32(v[i], bias);
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+        _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(w, w));
+        out += stride;
+    }
+}
+
+// _idct_1d_avx2 with v[4..7] zero, for _idct_8x8_low
+static inline __attribute__((target("avx2"))) void
+_idct_1d_low_avx2(__m256i *v, int sl, int bias, int rnd, int sh, int fs) {
+    __m256i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    const __m128i csl = _mm_cvtsi32_si128(sl);
+    const __m128i csh = _mm_cvtsi32_si128(sh);
+    const __m128i cfs = _mm_cvtsi32_si128(fs);
+    const __m256i crnd = _mm256_set1_epi32(rnd);
+#define MULC(a, k) _mm256_mullo_epi32((a), _mm256_set1_epi32(k))
+    x3 = v[2]; x4 = v[1]; x7 = v[3];
+    x0 = _mm256_add_epi32(_mm256_sll_epi32(v[0], csl), _mm256_set1_epi32(bias));
+    x8 = _mm256_add_epi32(MULC(x4, W7), crnd);
+    x4 = _mm256_sra_epi32(_mm256_add_epi32(x8, MULC(x4, W1 - W7)), csh);
+    x5 = _mm256_sra_epi32(x8, csh);
+    x8 = _mm256_add_epi32(MULC(x7, W3), crnd);
+    x6 = _mm256_sra_epi32(x8, csh);
+    x7 = _mm256_sra_epi32(_mm256_sub_epi32(x8, MULC(x7, W3 + W5)), csh);
+    x8 = x0;
+    x1 = _mm256_add_epi32(MULC(x3, W6), crnd);
+    x2 = _mm256_sra_epi32(x1, csh);
+    x3 = _mm256_sra_epi32(_mm256_add_epi32(x1, MULC(x3, W2 - W6)), csh);
+    x1 = _mm256_add_epi32(x4, x6);
+    x4 = _mm256_sub_epi32(x4, x6);
+    x6 = _mm256_add_epi32(x5, x7);
+    x5 = _mm256_sub_epi32(x5, x7);
+    x7 = _mm256_add_epi32(x8, x3);
+    x8 = _mm256_sub_epi32(x8, x3);
+    x3 = _mm256_add_epi32(x0, x2);
+    x0 = _mm256_sub_epi32(x0, x2);
+    x2 = _mm256_srai_epi32(_mm256_add_epi32(MULC(_mm256_add_epi32(x4, x5), 181), _mm256_set1_epi32(128)), 8);
+    x4 = _mm256_srai_epi32(_mm256_add_epi32(MULC(_mm256_sub_epi32(x4, x5), 181), _mm256_set1_epi32(128)), 8);
+#undef MULC
+    v[0] = _mm256_sra_epi32(_mm256_add_epi32(x7, x1), cfs);
+    v[1] = _mm256_sra_epi32(_mm256_add_epi32(x3, x2), cfs);
+    v[2] = _mm256_sra_epi32(_mm256_add_epi32(x0, x4), cfs);
+    v[3] = _mm256_sra_epi32(_mm256_add_epi32(x8, x6), cfs);
+    v[4] = _mm256_sra_epi32(_mm256_sub_epi32(x8, x6), cfs);
+    v[5] = _mm256_sra_epi32(_mm256_sub_epi32(x0, x4), cfs);
+    v[6] = _mm256_sra_epi32(_mm256_sub_epi32(x3, x2), cfs);
+    v[7] = _mm256_sra_epi32(_mm256_sub_epi32(x7, x1), cfs);
+}
+
+// coefs in the top left 4x4: rows 4..7 are zero, so are columns 4..7
+// once transposed, and the row pass leaves rows 4..7 zero again
+static __attribute__((target("avx2"))) void
+_idct_8x8_low_avx2(s32 *blk, u8 *out, int stride) {
+    int i;
+    __m256i v[8];
+    const __m256i bias = _mm256_set1_epi32(128);
+    for (i=0; i<4; i++) {
+        v[i] = _mm256_loadu_si256((const __m256i*)&blk[i*DCTSIZE]);
+        v[4+i] = _mm256_setzero_si256();
+    }
+    _transpose_8x8_avx2(v);
+    _idct_1d_low_avx2(v, IDCT_ROW_PASS);
+    _transpose_8x8_avx2(v);
+    _idct_1d_low_avx2(v, IDCT_COL_PASS);
+    for (i=0; i<8; i++) {
+        __m256i x = _mm256_add_epi32(v[i], bias);
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+        _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(w, w));
+        out += stride;
+    }
+}
+
+// sse2 has no 32 bits mullo, build it from two 32x32->64 muls
+static inline __m128i
+_mm_mullo_epi32_sse2(__m128i a, int k) {
+    const __m128i b = _mm_set1_epi32(k);
+    __m128i e = _mm_mul_epu32(a, b);
+    __m128i o = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(e, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(o, _MM_SHUFFLE(0,0,2,0)));
+}
+
+static inline void
+_idct_1d_sse2(__m128i *v, int sl, int bias, int rnd, int sh, int fs) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    const __m128i csl = _mm_cvtsi32_si128(sl);
+    const __m128i csh = _mm_cvtsi32_si128(sh);
+    const __m128i cfs = _mm_cvtsi32_si128(fs);
+    const __m128i crnd = _mm_set1_epi32(rnd);
+#define MULC(a, k) _mm_mullo_epi32_sse2((a), (k))
+    x1 = _mm_sll_epi32(v[4], csl);
+    x2 = v[6]; x3 = v[2]; x4 = v[1]; x5 = v[7]; x6 = v[5]; x7 = v[3];
+    x0 = _mm_add_epi32(_mm_sll_epi32(v[0], csl), _mm_set1_epi32(bias));
+    x8 = _mm_add_epi32(MULC(_mm_add_epi32(x4, x5), W7), crnd);
+    x4 = _mm_sra_epi32(_mm_add_epi32(x8, MULC(x4, W1 - W7)), csh);
+    x5 = _mm_sra_epi32(_mm_sub_epi32(x8, MULC(x5, W1 + W7)), csh);
+    x8 = _mm_add_epi32(MULC(_mm_add_epi32(x6, x7), W3), crnd);
+    x6 = _mm_sra_epi32(_mm_sub_epi32(x8, MULC(x6, W3 - W5)), csh);
+    x7 = _mm_sra_epi32(_mm_sub_epi32(x8, MULC(x7, W3 + W5)), csh);
+    x8 = _mm_add_epi32(x0, x1);
+    x0 = _mm_sub_epi32(x0, x1);
+    x1 = _mm_add_epi32(MULC(_mm_add_epi32(x3, x2), W6), crnd);
+    x2 = _mm_sra_epi32(_mm_sub_epi32(x1, MULC(x2, W2 + W6)), csh);
+    x3 = _mm_sra_epi32(_mm_add_epi32(x1, MULC(x3, W2 - W6)), csh);
+    x1 = _mm_add_epi32(x4, x6);
+    x4 = _mm_sub_epi32(x4, x6);
+    x6 = _mm_add_epi32(x5, x7);
+    x5 = _mm_sub_epi32(x5, x7);
+    x7 = _mm_add_epi32(x8, x3);
+    x8 = _mm_sub_epi32(x8, x3);
+    x3 = _mm_add_epi32(x0, x2);
+    x0 = _mm_sub_epi32(x0, x2);
+    x2 = _mm_srai_epi32(_mm_add_epi32(MULC(_mm_add_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    x4 = _mm_srai_epi32(_mm_add_epi32(MULC(_mm_sub_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+#undef MULC
+    v[0] = _mm_sra_epi32(_mm_add_epi32(x7, x1), cfs);
+    v[1] = _mm_sra_epi32(_mm_add_epi32(x3, x2), cfs);
+    v[2] = _mm_sra_epi32(_mm_add_epi32(x0, x4), cfs);
+    v[3] = _mm_sra_epi32(_mm_add_epi32(x8, x6), cfs);
+    v[4] = _mm_sra_epi32(_mm_sub_epi32(x8, x6), cfs);
+    v[5] = _mm_sra_epi32(_mm_sub_epi32(x0, x4), cfs);
+    v[6] = _mm_sra_epi32(_mm_sub_epi32(x3, x2), cfs);
+    v[7] = _mm_sra_epi32(_mm_sub_epi32(x7, x1), cfs);
+}
+
+static inline void
+_transpose_4x4_sse2(__m128i *r0, __m128i *r1, __m128i *r2, __m128i *r3) {
+    __m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+    __m128i t1 = _mm_unpacklo_epi32(*r2, *r3);
+    __m128i t2 = _mm_unpackhi_epi32(*r0, *r1);
+    __m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+    *r0 = _mm_unpacklo_epi64(t0, t1);
+    *r1 = _mm_unpackhi_epi64(t0, t1);
+    *r2 = _mm_unpacklo_epi64(t2, t3);
+    *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+static inline void
+_idct_1d_low_sse2(__m128i *v, int sl, int bias, int rnd, int sh, int fs) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    const __m128i csl = _mm_cvtsi32_si128(sl);
+    const __m128i csh = _mm_cvtsi32_si128(sh);
+    const __m128i cfs = _mm_cvtsi32_si128(fs);
+    const __m128i crnd = _mm_set1_epi32(rnd);
+#define MULC(a, k) _mm_mullo_epi32_sse2((a), (k))
+    x3 = v[2]; x4 = v[1]; x7 = v[3];
+    x0 = _mm_add_epi32(_mm_sll_epi32(v[0], csl), _mm_set1_epi32(bias));
+    x8 = _mm_add_epi32(MULC(x4, W7), crnd);
+    x4 = _mm_sra_epi32(_mm_add_epi32(x8, MULC(x4, W1 - W7)), csh);
+    x5 = _mm_sra_epi32(x8, csh);
+    x8 = _mm_add_epi32(MULC(x7, W3), crnd);
+    x6 = _mm_sra_epi32(x8, csh);
+    x7 = _mm_sra_epi32(_mm_sub_epi32(x8, MULC(x7, W3 + W5)), csh);
+    x8 = x0;
+    x1 = _mm_add_epi32(MULC(x3, W6), crnd);
+    x2 = _mm_sra_epi32(x1, csh);
+    x3 = _mm_sra_epi32(_mm_add_epi32(x1, MULC(x3, W2 - W6)), csh);
+    x1 = _mm_add_epi32(x4, x6);
+    x4 = _mm_sub_epi32(x4, x6);
+    x6 = _mm_add_epi32(x5, x7);
+    x5 = _mm_sub_epi32(x5, x7);
+    x7 = _mm_add_epi32(x8, x3);
+    x8 = _mm_sub_epi32(x8, x3);
+    x3 = _mm_add_epi32(x0, x2);
+    x0 = _mm_sub_epi32(x0, x2);
+    x2 = _mm_srai_epi32(_mm_add_epi32(MULC(_mm_add_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+    x4 = _mm_srai_epi32(_mm_add_epi32(MULC(_mm_sub_epi32(x4, x5), 181), _mm_set1_epi32(128)), 8);
+#undef MULC
+    v[0] = _mm_sra_epi32(_mm_add_epi32(x7, x1), cfs);
+    v[1] = _mm_sra_epi32(_mm_add_epi32(x3, x2), cfs);
+    v[2] = _mm_sra_epi32(_mm_add_epi32(x0, x4), cfs);
+    v[3] = _mm_sra_epi32(_mm_add_epi32(x8, x6), cfs);
+    v[4] = _mm_sra_epi32(_mm_sub_epi32(x8, x6), cfs);
+    v[5] = _mm_sra_epi32(_mm_sub_epi32(x0, x4), cfs);
+    v[6] = _mm_sra_epi32(_mm_sub_epi32(x3, x2), cfs);
+    v[7] = _mm_sra_epi32(_mm_sub_epi32(x7, x1), cfs);
+}
+
+static void
+_idct_8x8_sse2(s32 *blk, u8 *out, int stride) {
+    int i, h;
+    __m128i v[8];
+    s32 tmp[DCTSIZE2] __attribute__((aligned(16)));
+    const __m128i bias = _mm_set1_epi32(128);
+    // row pass on 4 rows a time, lane = row
+    for (h=0; h<DCTSIZE2; h+=DCTSIZE2/2) {
+        for (i=0; i<8; i++)
+            v[i] = _mm_loadu_si128((const __m128i*)&blk[h + (i&3)*DCTSIZE + (i>>2)*4]);
+        _transpose_4x4_sse2(&v[0], &v[1], &v[2], &v[3]);
+        _transpose_4x4_sse2(&v[4], &v[5], &v[6], &v[7]);
+        _idct_1d_sse2(v, IDCT_ROW_PASS);
+        _transpose_4x4_sse2(&v[0], &v[1], &v[2], &v[3]);
+        _transpose_4x4_sse2(&v[4], &v[5], &v[6], &v[7]);
+        for (i=0; i<8; i++)
+            _mm_store_si128((__m128i*)&tmp[h + (i&3)*DCTSIZE + (i>>2)*4], v[i]);
+    }
+    // column pass on 4 columns a time, lane = column
+    for (h=0; h<DCTSIZE; h+=DCTSIZE/2) {
+        u8 *o = out + h;
+        for (i=0; i<8; i++)
+            v[i] = _mm_load_si128((const __m128i*)&tmp[i*DCTSIZE + h]);
+        _idct_1d_sse2(v, IDCT_COL_PASS);
+        for (i=0; i<8; i++) {
+            __m128i w = _mm_packs_epi32(_mm_add_epi32(v[i], bias), bias);
+            *(int*)o = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+            o += stride;
+        }
+    }
+}
+
+// top left 4x4 coefs: one row pass on the 4x4, columns read rows 0..3
+static void
+_idct_8x8_low_sse2(s32 *blk, u8 *out, int stride) {
+    int i, h;
+    __m128i v[8];
+    s32 tmp[DCTSIZE2/2] __attribute__((aligned(16)));
+    const __m128i bias = _mm_set1_epi32(128);
+    for (i=0; i<4; i++)
+        v[i] = _mm_loadu_si128((const __m128i*)&blk[i*DCTSIZE]);
+    _transpose_4x4_sse2(&v[0], &v[1], &v[2], &v[3]);
+    _idct_1d_low_sse2(v, IDCT_ROW_PASS);
+    _transpose_4x4_sse2(&v[0], &v[1], &v[2], &v[3]);
+    _transpose_4x4_sse2(&v[4], &v[5], &v[6], &v[7]);
+    for (i=0; i<8; i++)
+        _mm_store_si128((__m128i*)&tmp[(i&3)*DCTSIZE + (i>>2)*4], v[i]);
+    for (h=0; h<DCTSIZE; h+=DCTSIZE/2) {
+        u8 *o = out + h;
+        for (i=0; i<4; i++)
+            v[i] = _mm_load_si128((const __m128i*)&tmp[i*DCTSIZE + h]);
+        _idct_1d_low_sse2(v, IDCT_COL_PASS);
+        for (i=0; i<8; i++) {
+            __m128i w = _mm_packs_epi32(_mm_add_epi32(v[i], bias), bias);
+            *(int*)o = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+            o += stride;
+        }
+    }
+}
+#endif  /* JD_X86 */
+
+void
+_ycc_rgb_line_c(const u8 *py, const u8 *pcb, const u8 *pcr, u8 *out, int n) {
+    int x;
+    for (x=0; x<n; x++) {
+        register s32 y = py[x] << 8;
+        register s32 cb = pcb[x] - 128;
+        register s32 cr = pcr[x] - 128;
+        out[x*3  ] = _truncate((y +            359 * cr + 128) >> 8);
+        out[x*3+1] = _truncate((y -  88 * cb - 183 * cr + 128) >> 8);
+        out[x*3+2] = _truncate((y + 454 * cb            + 128) >> 8);
+    }
+}
+
+#ifdef JD_X86
+// (y<<8 + k*c + 128) >> 8 equals y + ((k*c + 128) >> 8), so only the
+// chroma terms need 32 bits, a madd of (c0,c1) pairs gives them exact
+#define YCC_K(k0, k1) ((s32)((u32)(u16)(k1) << 16 | (u16)(k0)))
+
+static inline __m128i
+_ycc_term_sse2(__m128i c0, __m128i c1, __m128i k) {
+    const __m128i rnd = _mm_set1_epi32(128);
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c0, c1), k), rnd);
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c0, c1), k), rnd);
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+static void
+_ycc_rgb_line_sse2(const u8 *py, const u8 *pcb, const u8 *pcr, u8 *out, int n) {
+    int x, i, h;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i kr = _mm_set1_epi32(YCC_K(359, 0));
+    const __m128i kg = _mm_set1_epi32(YCC_K(-88, -183));
+    const __m128i kb = _mm_set1_epi32(YCC_K(454, 0));
+    u8 rgb[3][16];
+    for (x=0; x+16<=n; x+=16) {
+        __m128i vy = _mm_loadu_si128((const __m128i*)&py[x]);
+        __m128i vcb = _mm_loadu_si128((const __m128i*)&pcb[x]);
+        __m128i vcr = _mm_loadu_si128((const __m128i*)&pcr[x]);
+        __m128i r[2], g[2], b[2];
+        for (h=0; h<2; h++) {
+            __m128i y = h ? _mm_unpackhi_epi8(vy, zero) : _mm_unpacklo_epi8(vy, zero);
+            __m128i cb = h ? _mm_unpackhi_epi8(vcb, zero) : _mm_unpacklo_epi8(vcb, zero);
+            __m128i cr = h ? _mm_unpackhi_epi8(vcr, zero) : _mm_unpacklo_epi8(vcr, zero);
+            cb = _mm_sub_epi16(cb, c128);
+            cr = _mm_sub_epi16(cr, c128);
+            r[h] = _mm_add_epi16(y, _ycc_term_sse2(cr, zero, kr));
+            g[h] = _mm_add_epi16(y, _ycc_term_sse2(cb, cr, kg));
+            b[h] = _mm_add_epi16(y, _ycc_term_sse2(cb, zero, kb));
+        }
+        _mm_storeu_si128((__m128i*)rgb[0], _mm_packus_epi16(r[0], r[1]));
+        _mm_storeu_si128((__m128i*)rgb[1], _mm_packus_epi16(g[0], g[1]));
+        _mm_storeu_si128((__m128i*)rgb[2], _mm_packus_epi16(b[0], b[1]));
+        for (i=0; i<16; i++) {  /* no byte shuffle in sse2 */
+            out[x*3+i*3  ] = rgb[0][i];
+            out[x*3+i*3+1] = rgb[1][i];
+            out[x*3+i*3+2] = rgb[2][i];
+        }
+    }
+    _ycc_rgb_line_c(&py[x], &pcb[x], &pcr[x], &out[x*3], n - x);
+}
+
+static inline __attribute__((target("avx2"))) __m256i
+_ycc_term_avx2(__m256i c0, __m256i c1, __m256i k) {
+    const __m256i rnd = _mm256_set1_epi32(128);
+    __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(c0, c1), k), rnd);
+    __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(c0, c1), k), rnd);
+    /* in-lane unpack then in-lane pack keeps the pixel order */
+    return _mm256_packs_epi32(_mm256_srai_epi32(lo, 8), _mm256_srai_epi32(hi, 8));
+}
+
+static inline __attribute__((target("avx2"))) __m128i
+_pack_u8_avx2(__m256i x) {
+    x = _mm256_packus_epi16(x, x);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(3,1,2,0)));
+}
+
+static __attribute__((target("avx2"))) void
+_ycc_rgb_line_avx2(const u8 *py, const u8 *pcb, const u8 *pcr, u8 *out, int n) {
+    int x;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c128 = _mm256_set1_epi16(128);
+    const __m256i kr = _mm256_set1_epi32(YCC_K(359, 0));
+    const __m256i kg = _mm256_set1_epi32(YCC_K(-88, -183));
+    const __m256i kb = _mm256_set1_epi32(YCC_K(454, 0));
+    /* byte i of the k-th 16 bytes out comes from channel i%3, pixel i/3 */
+    const __m128i s0r = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+    const __m128i s0g = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+    const __m128i s0b = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i s1r = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+    const __m128i s1g = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+    const __m128i s1b = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+    const __m128i s2r = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+    const __m128i s2g = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+    const __m128i s2b = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+    for (x=0; x+16<=n; x+=16) {
+        __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&py[x]));
+        __m256i cb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&pcb[x]));
+        __m256i cr = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&pcr[x]));
+        __m128i r, g, b;
+        cb = _mm256_sub_epi16(cb, c128);
+        cr = _mm256_sub_epi16(cr, c128);
+        r = _pack_u8_avx2(_mm256_add_epi16(y, _ycc_term_avx2(cr, zero, kr)));
+        g = _pack_u8_avx2(_mm256_add_epi16(y, _ycc_term_avx2(cb, cr, kg)));
+        b = _pack_u8_avx2(_mm256_add_epi16(y, _ycc_term_avx2(cb, zero, kb)));
+        _mm_storeu_si128((__m128i*)&out[x*3], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, s0r), _mm_shuffle_epi8(g, s0g)), _mm_shuffle_epi8(b, s0b)));
+        _mm_storeu_si128((__m128i*)&out[x*3+16], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, s1r), _mm_shuffle_epi8(g, s1g)), _mm_shuffle_epi8(b, s1b)));
+        _mm_storeu_si128((__m128i*)&out[x*3+32], _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, s2r), _mm_shuffle_epi8(g, s2g)), _mm_shuffle_epi8(b, s2b)));
+    }
+    _ycc_rgb_line_c(&py[x], &pcb[x], &pcr[x], &out[x*3], n - x);
+}
+#endif  /* JD_X86 */
+
+static void (*_ycc_rgb_line)(const u8 *py, const u8 *pcb, const u8 *pcr, u8 *out, int n) = _ycc_rgb_line_c;
+
+// comp pixels row r, clamped into comp, in its ring slot
+static inline const u8*
+_comp_row(struct s_jcomp *c, int r) {
+    if (r < 0) r = 0;
+    if (r >= c->height) r = c->height - 1;
+    return &c->pixels[(size_t)((r / c->lines) % c->slots * c->lines + r % c->lines) * c->stride];
+}
+
+// fancy upsampling as libjpeg, triangle filter between the nearer and the
+// farther chroma sample; one row at a time, chroma plane never upsampled.
+// dst starts at the window, comp columns are offset by x0 in the ring
+static const u8*
+_upsample_row(struct s_jctx *j, struct s_jcomp *c, int r, u8 *dst) {
+    int i, o = c->x0, last = c->width - 1;
+    int x0 = j->out_x, x1 = j->out_x + j->out_w;
+    const u8 *near, *far;
+    if (c->v_up == 1) {
+        near = far = _comp_row(c, r);
+        if (c->h_up == 1)
+            return near + x0 - o;
+    }
+    else {
+        near = _comp_row(c, r >> 1);
+        far = _comp_row(c, (r & 1) ? (r >> 1) + 1 : (r >> 1) - 1);
+    }
+    if (c->h_up == 1) {
+        for (i=x0; i<x1; i++)
+            dst[i-x0] = (3 * near[i-o] + far[i-o] + 1 + (r & 1)) >> 2;
+    }
+    else if (c->v_up == 1) {
+        for (i=x0>>1; i<=(x1-1)>>1; i++) {
+            int cur = 3 * near[i-o];
+            if (2*i >= x0)
+                dst[2*i-x0] = (cur + near[(i>0 ? i-1 : 0)-o] + 1) >> 2;
+            if (2*i+1 < x1)
+                dst[2*i+1-x0] = (cur + near[(i<last ? i+1 : last)-o] + 2) >> 2;
+        }
+    }
+    else {
+        int cl, cc, cn;
+        i = x0 >> 1;
+        cc = 3 * near[i-o] + far[i-o];
+        cl = i > 0 ? 3 * near[i-1-o] + far[i-1-o] : cc;
+        for (; i<=(x1-1)>>1; i++) {
+            cn = (i<last) ? (3 * near[i+1-o] + far[i+1-o]) : cc;
+            if (2*i >= x0)
+                dst[2*i-x0] = (3 * cc + cl + 8) >> 4;
+            if (2*i+1 < x1)
+                dst[2*i+1-x0] = (3 * cc + cn + 7) >> 4;
+            cl = cc;
+            cc = cn;
+        }
+    }
+    return dst;
+}
+
+// planar output, the window part of mcu line y of each comp copied as it
+// is, chroma not upsampled
+static void
+_copy_mcu_planes(struct s_jctx *j, int y) {
+    int i, r;
+    for (i=0; i<j->comp_count; i++) {
+        struct s_jcomp *c = &j->comp[i];
+        int x0 = j->out_x / c->h_up, y0 = j->out_y / c->v_up;
+        int r0 = y * c->lines, r1 = r0 + c->lines;
+        u8 *plane = j->planes.plane[i];
+        if (r0 < y0) r0 = y0;
+        if (r1 > y0 + j->info.plane_h[i]) r1 = y0 + j->info.plane_h[i];
+        for (r=r0; r<r1; r++)
+            memcpy(&plane[(size_t)(r - y0) * j->planes.stride[i]],
+                   _comp_row(c, r) + x0 - c->x0, j->info.plane_w[i]);
+    }
+}
+
+// YUV to RGB, the window part of mcu line y of comps pixels to scan_out
+void
+_convert_mcu_line(struct s_jctx *j, int y, u8 *scan_out, u8 *up_buf) {
+    int row, n = j->out_w, rowlen = n * j->comp_count;
+    int r0 = y * j->mcu_sizey, r1 = r0 + j->mcu_sizey;
+    struct s_jcomp *c0 = &j->comp[0];
+    u8 *out;
+    STAGE_MARK(j, t);
+    if ( j->planar ) {
+        _copy_mcu_planes(j, y);
+        STAGE_ADD(j, JD_STAGE_COLOR, t);
+        return;
+    }
+    if (r0 < j->out_y) r0 = j->out_y;
+    if (r1 > j->out_y + j->out_h) r1 = j->out_y + j->out_h;
+    if (r0 >= r1)
+        return;
+    // straight into the caller frame, or the line buffer for the sink
+    if ( j->pixels )
+        scan_out = &j->pixels[(size_t)(r0 - j->out_y) * rowlen];
+    for (row=r0, out=scan_out; row<r1; row++, out+=rowlen) {
+        const u8 *py = _comp_row(c0, row) + j->out_x - c0->x0;
+        if (j->comp_count == 1) {
+            memcpy(out, py, n);
+        }
+        else {
+            const u8 *pcb = _upsample_row(j, &j->comp[1], row, up_buf);
+            const u8 *pcr = _upsample_row(j, &j->comp[2], row, up_buf + n);
+            _ycc_rgb_line(py, pcb, pcr, out, n);
+        }
+    }
+    STAGE_ADD(j, JD_STAGE_COLOR, t);
+    if ( !j->pixels )
+        j->row_cb(j->row_user, &j->info, scan_out, r0 - j->out_y, r1 - r0);
+}
+
+static void (*_idct_8x8)(s32 *blk, u8 *out, int stride) = _idct_8x8_c;
+static void (*_idct_8x8_low)(s32 *blk, u8 *out, int stride) = _idct_8x8_low_c;
+
+// pick kernels for this cpu, JD_SIMD=c|sse2|avx2 forces one for validation
+void
+_init_dispatch(void) {
+    static int inited = 0;
+    const char *force = getenv("JD_SIMD");
+    if ( inited ) return;
+    inited = 1;
+#ifdef JD_BENCH
+    _stage_calibrate();
+#endif
+    _idct_8x8 = _idct_8x8_c;
+    _idct_8x8_low = _idct_8x8_low_c;
+    _ycc_rgb_line = _ycc_rgb_line_c;
+#ifdef JD_X86
+    __builtin_cpu_init();
+    if (force && !strcmp(force, "c"))
+        return;
+    if (__builtin_cpu_supports("avx2") && !(force && strcmp(force, "avx2"))) {
+        _idct_8x8 = _idct_8x8_avx2;
+        _idct_8x8_low = _idct_8x8_low_avx2;
+        _ycc_rgb_line = _ycc_rgb_line_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        _idct_8x8 = _idct_8x8_sse2;
+        _idct_8x8_low = _idct_8x8_low_sse2;
+        _ycc_rgb_line = _ycc_rgb_line_sse2;
+    }
+#endif
+}
+
+int
+_check_vlc_in_ht(struct s_bctx *b, const struct s_ht_tbl *ht, u8 *code) {
+    int n, val;
+    u32 bits = _bits_try(b, VLC_LOOKAHEAD);
+    s32 f = ht->fast[bits];
+    u8 c;
+    if ( f ) {                  /* vlc and extra bits in one lookup */
+        _bits_skip(b, f & 0xff);
+        if ( code ) { *code = (u8)(f >> 8); }
+        return f >> 16;
+    }
+    if ( ht->look[bits] ) {
+        n = ht->look[bits] >> 8;
+        c = ht->look[bits] & 0xff;
+    }
+    else {
+        bits = _bits_try(b, VLC_MAX_LEN);
+        for (n=VLC_LOOKAHEAD+1; n<=VLC_MAX_LEN; n++) {
+            val = bits >> (VLC_MAX_LEN - n);
+            if (val <= ht->maxcode[n])
+                break;
+        }
+        if (n > VLC_MAX_LEN) {
+            // corrupt or truncated, stop fetching and leave the rest blank
+            if ( !b->r_eof )
+                _log(D_ERROR, "# Fail to decode huff at %d, val %s #\n", _get_offset(b), _print_binary(bits, 16));
+            _set_eof(b);
+            b->r_marker = 1;
+            b->r_bad = 1;
+            _bits_skip(b, VLC_MAX_LEN);
+            return 0;
+        }
+        c = ht->huffval[ht->valptr[n] + val];
+    }
+    _log(D_VERBOSE, "code:%x bits:%d\n", c, n);
+    _bits_skip(b, n);
+    if ( code ) { *code = c; }
+    n = c & 0xf;
+    if ( !n ) { _log(D_VERBOSE, "-- bits 0\n"); return 0; }
+    val = _vlc_extend(_bits_read(b, n), n);
+    _log(D_VERBOSE, "decode val:%x, bits %d\n", val&0xff, n);
+    return val;
+}
+
+// idct of a dequantized block, its last coef at zigzag index last. dc only
+// blocks are flat, (dc + 4) >> 3 at every size; coefs within the top
+// left 4x4 take the reduced kernel. vec is all zero between blocks, only
+// what was written is cleared again
+static inline void
+_idct_block(struct s_jctx *j, s32 *vec, int last, u8 *out, int stride) {
+    int i;
+    if ( !last ) {
+        u8 v = _truncate(((vec[0] + 4) >> 3) + 128);
+        for (i=0; i<j->bsize; i++, out+=stride)
+            memset(out, v, j->bsize);
+        vec[0] = 0;
+        return;
+    }
+    if (last <= ZZ_LOW_LAST && j->idct == _idct_8x8)
+        _idct_8x8_low(vec, out, stride);
+    else
+        j->idct(vec, out, stride);
+    if (last < 16) {
+        for (i=0; i<=last; i++)
+            vec[_IZZ[i]] = 0;
+    }
+    else {
+        memset(vec, 0, DCTSIZE2*sizeof(vec[0]));
+    }
+}
+
+// get DC/AC and de-quant, invert zig-zag. tables come from k, the block
+// of the mcu, c is the comp whose dc and vec it uses
+static inline void
+_decode_block(struct s_bctx *b, struct s_jctx *j, const struct s_mcu_blk *k,
+              struct s_jcomp *c, u8 *out) {
+    int ai, val, last = 0;
+    const u16 *qtbl = k->q;
+    STAGE_MARK(j, t);
+
+    // get DC
+    val = _check_vlc_in_ht(b, k->dc, NULL);
+    c->dc += val;
+    c->vec[0] = c->dc * qtbl[0];
+    //_log(D_VERBOSE, "DC %d\n", c->dc);
+    
+    // get AC
+    for (ai=1; ai<64; ai++) {
+        u8 code = 0;
+        val = _check_vlc_in_ht(b, k->ac, &code);
+        if ( !code ) { _log(D_VERBOSE, "-- EOB\n"); break; }    /* EOB */
+        else {
+            ai += (code >> 4);
+            if (ai > 63) break;
+            if ( j->zz_keep[ai] ) { /* only what the scaled idct reads */
+                c->vec[(s32) _IZZ[ai] ] = val * qtbl[ai]; /* dequant */
+                last = ai;
+            }
+        }
+    }
+    STAT_ADD(blocks, 1);
+    STAT_ADD(eob[ai > 64 ? 63 : ai - 1], 1);
+
+    //_dump_buf((u8*)c->vec);
+    
     // idct
-    for (i=0; i<DCTSIZE2; i+=DCTSIZE)
-        _idct_row( &c->vec[i] );
-    for (i=0; i<DCTSIZE; i++)
-        _idct_col( &c->vec[i], &c->pixels[i], DCTSIZE);
+    STAGE_ADD(j, JD_STAGE_ENTROPY, t);
+    _idct_block(j, c->vec, last, out, c->stride);
+    STAGE_ADD(j, JD_STAGE_IDCT, t);
+
+    //_dump_buf(out, c->stride);
+}
+
+static void
+_decode_mcu(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *comp, int x, int y) {
+    int i;
+    for (i=0; i<j->mcu_blocks; i++) {
+        struct s_jcomp *c = &comp[j->mcu_comp[i]];
+        u8 *out = &c->pixels[(size_t)(y % c->slots) * c->lines * c->stride];
+        _decode_block(b, j, &j->mcu_blk[i], c, &out[(x - j->mcu_x0)*c->h_samp*j->bsize + j->mcu_offset[i]]);
+    }
+}
+
+// entropy decode only, for dc prediction and bit position
+static void
+_skip_mcu(struct s_bctx *b, struct s_jctx *j) {
+    int i, ai;
+    STAGE_MARK(j, t);
+    for (i=0; i<j->mcu_blocks; i++) {
+        struct s_jcomp *c = &j->comp[j->mcu_comp[i]];
+        const struct s_ht_tbl *htbl = j->htbl[c->ht_ac_id];
+        c->dc += _check_vlc_in_ht(b, j->htbl[c->ht_dc_id], NULL);
+        for (ai=1; ai<64; ai++) {
+            u8 code = 0;
+            _check_vlc_in_ht(b, htbl, &code);
+            if ( !code ) break;
+            ai += code >> 4;
+        }
+    }
+    STAT_ADD(blocks_skipped, j->mcu_blocks);
+    STAGE_ADD(j, JD_STAGE_ENTROPY, t);
+}
+
+// restart intervals are independent, each worker takes whole intervals
+// with its own bit reader and dc, blocks go to whole image comp planes,
+// then mcu lines are converted in parallel
+struct s_jworker {
+    struct s_jctx *j;
+    struct s_bctx b;
+    struct s_jcomp comp[3];
+    const int *seg_offset;      /* entropy data offset of each interval */
+    int seg_count;
+    volatile int *seg_next;     /* next interval to take, shared */
+    int line_first, line_last;  /* mcu lines to convert */
+    u8 *scan_out;
+    u8 *up_buf;
+    void (*run)(struct s_jworker *w);
+    pthread_t tid;
+    int started;
+};
+
+static void
+_decode_segments(struct s_jworker *w) {
+    struct s_jctx *j = w->j;
+    int total = j->h_mcus * j->v_mcus;
+    for (;;) {
+        int i, m, end, seg = __sync_fetch_and_add(w->seg_next, 1);
+        if (seg >= w->seg_count)
+            break;
+        w->b.r_ptr = w->seg_offset[seg];
+        w->b.r_eof = 0;
+        _bits_clear(&w->b);
+        for (i=0; i<j->comp_count; i++)
+            w->comp[i].dc = 0;
+        m = seg * j->restintv;
+        end = m + j->restintv < total ? m + j->restintv : total;
+        for (; m<end; m++)
+            _decode_mcu(&w->b, j, w->comp, m % j->h_mcus, m / j->h_mcus);
+    }
+}
+
+static void
+_convert_lines(struct s_jworker *w) {
+    int y;
+    for (y=w->line_first; y<w->line_last; y++)
+        _convert_mcu_line(w->j, y, w->scan_out, w->up_buf);
+}
+
+static void*
+_jworker_main(void *arg) {
+    struct s_jworker *w = arg;
+    STAGE_BEGIN();
+    w->run(w);
+    STAGE_END(w->j);
+    return NULL;
+}
+
+// run on n threads, the share of one that can not start runs on this one
+static void
+_run_workers(struct s_jworker *w, int n, void (*run)(struct s_jworker *w)) {
+    int i;
+    for (i=0; i<n; i++) {
+        w[i].run = run;
+        w[i].started = pthread_create(&w[i].tid, NULL, _jworker_main, &w[i]) == 0;
+    }
+    for (i=0; i<n; i++)
+        if ( !w[i].started )
+            run(&w[i]);
+    for (i=0; i<n; i++)
+        if ( w[i].started )
+            pthread_join(w[i].tid, NULL);
+}
+
+// entropy data offsets after SOS and each RSTn, stops at the end of scan
+static int
+_scan_restarts(struct s_bctx *b, int *offset, int max, int *end) {
+    int n = 0, p = b->r_ptr;
+    offset[n++] = p;
+    while (p + 1 < b->len) {
+        u8 m;
+        if (b->r_data[p++] != 0xff)
+            continue;
+        m = b->r_data[p];
+        if (m == 0x00 || m == 0xff)
+            continue;
+        if ((m & 0xf8) != 0xd0)
+            break;
+        if (n < max)
+            offset[n] = p + 1;
+        n++;
+        p++;
+    }
+    *end = p - 1;
+    return n;
+}
+
+int
+_decode_scan_mt(struct s_bctx *b, struct s_jctx *j) {
+    int i, end, seg_next = 0, nthread = j->threads;
+    int segs = (j->h_mcus * j->v_mcus + j->restintv - 1) / j->restintv;
+    int line_buf = j->scan_len + j->out_w * 2;
+    int *offset = _arena_alloc(&j->arena, sizeof(int) * segs);
+    struct s_jworker *w = _arena_alloc(&j->arena, (sizeof(*w) + line_buf) * nthread);
+    if (!offset || !w || _scan_restarts(b, offset, segs, &end) < segs) {
+        _log(D_INFO, "# Restart markers mismatch, decode in one thread #\n");
+        return 0;
+    }
+    for (i=0; i<j->comp_count; i++) {
+        struct s_jcomp *c = &j->comp[i];
+        if (c->slots < j->v_mcus) {
+            u8 *p = _arena_alloc(&j->arena, (size_t)c->stride * c->lines * j->v_mcus);
+            if ( !p ) return 0;
+            c->pixels = p;
+            c->slots = j->v_mcus;
+        }
+    }
+    _log(D_COEFF, "\tdecode %d restart intervals in %d threads\n", segs, nthread);
+    for (i=0; i<nthread; i++) {
+        u8 *lines = (u8*)&w[nthread] + line_buf * i;
+        w[i].j = j;
+        w[i].b = *b;
+        memcpy(w[i].comp, j->comp, sizeof(w[i].comp));
+        w[i].seg_offset = offset;
+        w[i].seg_count = segs;
+        w[i].seg_next = &seg_next;
+        w[i].line_first = j->v_mcus * i / nthread;
+        w[i].line_last = j->v_mcus * (i + 1) / nthread;
+        w[i].scan_out = lines;
+        w[i].up_buf = lines + j->scan_len;
+    }
+    _run_workers(w, nthread, _decode_segments);
+    for (i=0; i<nthread; i++)
+        b->r_bad |= w[i].b.r_bad;
+    if (j->pixels || j->planar) {
+        _run_workers(w, nthread, _convert_lines);
+    }
+    else {
+        // the sink takes lines in order
+        for (i=0; i<j->v_mcus; i++)
+            _convert_mcu_line(j, i, j->scan_out, j->up_buf);
+    }
+    b->r_ptr = end;             /* marker after scan */
+    _bits_clear(b);
+    STAT_ADD(restarts, segs - 1);
+    return 1;
+}
+
+// progressive scans, G.1.2 of the spec. DC first scan gives dc << al,
+// refine scans add one bit a scan; AC first scans decode band ss..se with
+// EOB runs over blocks, AC refine scans add one bit to nonzero coefs and
+// place new +-1 coefs on zero ones
+static void
+_decode_dc_prog(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *c, s16 *blk, int ah, int al) {
+    if ( !ah ) {
+        c->dc += _check_vlc_in_ht(b, j->htbl[c->ht_dc_id], NULL);
+        blk[0] = c->dc * (1 << al);
+    }
+    else if (_bits_read(b, 1)) {
+        blk[0] |= 1 << al;
+    }
+}
+
+static void
+_decode_ac_first(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *c, s16 *blk, int ss, int se, int al) {
+    int k;
+    const struct s_ht_tbl *htbl = j->htbl[c->ht_ac_id];
+    if (j->eobrun > 0) {
+        j->eobrun--;
+        return;
+    }
+    for (k=ss; k<=se; k++) {
+        u8 code = 0;
+        int val = _check_vlc_in_ht(b, htbl, &code);
+        int r = code >> 4;
+        if ( !(code & 0xf) ) {
+            if (r < 15) {       /* EOBn */
+                j->eobrun = (1 << r) - 1;
+                if ( r ) j->eobrun += _bits_read(b, r);
+                break;
+            }
+            k += 15;            /* ZRL */
+            continue;
+        }
+        k += r;
+        if (k > 63) break;
+        blk[_IZZ[k]] = val * (1 << al);
+    }
+}
+
+static void
+_decode_ac_refine(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *c, s16 *blk, int ss, int se, int al) {
+    int k = ss;
+    int p1 = 1 << al, m1 = -1 * (1 << al);
+    const struct s_ht_tbl *htbl = j->htbl[c->ht_ac_id];
+    if (j->eobrun == 0) {
+        for (; k<=se; k++) {
+            u8 code = 0;
+            int val = _check_vlc_in_ht(b, htbl, &code);
+            int r = code >> 4;
+            int s = 0;
+            if (code & 0xf) {
+                s = val > 0 ? p1 : m1;  /* new coef is always +-1 */
+            }
+            else if (r < 15) {
+                j->eobrun = 1 << r;
+                if ( r ) j->eobrun += _bits_read(b, r);
+                break;
+            }
+            // skip r zero coefs, refine the nonzero ones met on the way
+            for (; k<=se; k++) {
+                s16 *coef = &blk[_IZZ[k]];
+                if ( *coef ) {
+                    if (_bits_read(b, 1) && !(*coef & p1))
+                        *coef += (*coef >= 0) ? p1 : m1;
+                }
+                else if (--r < 0) {
+                    break;
+                }
+            }
+            if (s && k <= 63)
+                blk[_IZZ[k]] = s;
+        }
+    }
+    if (j->eobrun > 0) {
+        for (; k<=se; k++) {
+            s16 *coef = &blk[_IZZ[k]];
+            if (*coef && _bits_read(b, 1) && !(*coef & p1))
+                *coef += (*coef >= 0) ? p1 : m1;
+        }
+        j->eobrun--;
+    }
+}
+
+static void
+_decode_block_prog(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *c, int bx, int by,
+                   int ss, int se, int ah, int al) {
+    s16 *blk = &c->coef[(by * c->bw + bx) * DCTSIZE2];
+    STAGE_MARK(j, t);
+    if (ss == 0)
+        _decode_dc_prog(b, j, c, blk, ah, al);
+    else if ( !ah )
+        _decode_ac_first(b, j, c, blk, ss, se, al);
+    else
+        _decode_ac_refine(b, j, c, blk, ss, se, al);
+    STAGE_ADD(j, JD_STAGE_ENTROPY, t);
+}
+
+// restart every comp's dc and eob run, 0 when EOI met. no marker
+// follows the last interval, what comes next belongs to the next segment
+static int
+_decode_restart(struct s_bctx *b, struct s_jctx *j) {
+    int i;
+    u16 RSTx;
+    if ( !j->restintv_left )
+        return 1;
+    j->restintv_left--;
+    RSTx = _next_word(b);
+    _bits_clear(b);
+    if (RSTx == M_EOI) {
+        _skip_bytes(b, -2);
+        b->r_bad = 1;           /* intervals left, stream cut short */
+        return 0;
+    }
+    _log(D_VERBOSE, "RST meets %4x, %04x\n", RSTx, j->restintv_next);
+    if (((RSTx&0xfff8)!=0xffd0) || ((RSTx&0x7)!=j->restintv_next)) {
+        _log(D_ERROR, "# Bad restart marker %04x at %d #\n", RSTx, _get_offset(b));
+        _set_eof(b);            /* rest of the scan is left blank */
+        b->r_bad = 1;
+        return 0;
+    }
+    j->restintv_next = (RSTx + 1) & 0x7;
+    j->restintv_cnt = j->restintv;
+    j->eobrun = 0;
+    STAT_ADD(restarts, 1);
+    for (i=0; i<j->comp_count; i++) {
+        j->comp[i].dc = 0;
+    }
+    return 1;
+}
+
+// markers between the restart intervals of a scan of mcus
+static void
+_restart_left(struct s_jctx *j, int mcus) {
+    j->restintv_left = j->restintv ? (mcus - 1) / j->restintv : 0;
+}
+
+void
+_decode_scan_prog(struct s_bctx *b, struct s_jctx *j, int comp, const int *scomp,
+                  int ss, int se, int ah, int al) {
+    int i, x, y;
+    if ((ss > se) || (se > 63) || (ss == 0 && se != 0) || (ss > 0 && comp != 1)) {
+        _log(D_ERROR, "# Bad progressive scan %d..%d ! #\n", ss, se);
+        j->err = JD_ERROR;
+        _set_eof(b);
+        return;
+    }
+    j->eobrun = 0;
+    j->restintv_cnt = j->restintv;
+    j->restintv_next = 0;
+    for (i=0; i<j->comp_count; i++)
+        j->comp[i].dc = 0;
+    if (comp == 1) {
+        // non-interleaved, one block a mcu, only blocks inside the comp
+        struct s_jcomp *c = &j->comp[scomp[0]];
+        int bw = (c->width + j->bsize - 1) / j->bsize;
+        int bh = (c->height + j->bsize - 1) / j->bsize;
+        _restart_left(j, bw * bh);
+        for (y=0; y<bh; y++) {
+            for (x=0; x<bw; x++) {
+                _decode_block_prog(b, j, c, x, y, ss, se, ah, al);
+                if (j->restintv && !(--j->restintv_cnt) && !_decode_restart(b, j))
+                    return;
+            }
+        }
+        return;
+    }
+    _restart_left(j, j->h_mcus * j->v_mcus);
+    for (y=0; y<j->v_mcus; y++) {
+        for (x=0; x<j->h_mcus; x++) {
+            for (i=0; i<comp; i++) {
+                int bx, by;
+                struct s_jcomp *c = &j->comp[scomp[i]];
+                for (by=0; by<c->v_samp; by++)
+                    for (bx=0; bx<c->h_samp; bx++)
+                        _decode_block_prog(b, j, c, x*c->h_samp+bx, y*c->v_samp+by, ss, se, ah, al);
+            }
+            if (j->restintv && !(--j->restintv_cnt) && !_decode_restart(b, j))
+                return;
+        }
+    }
+}
+
+// dequant, idct and convert coef once all scans are done
+void
+_finish_prog(struct s_jctx *j) {
+    int i, k, last, x, y, by;
+    // a comp no scan covered was not checked at SOS
+    for (i=0; i<j->comp_count; i++) {
+        if ( !j->qtbl[j->comp[i].qtbl_id] ) {
+            _log(D_ERROR, "# Quantization table %d undefined ! #\n", j->comp[i].qtbl_id);
+            j->err = JD_ERROR;
+            return;
+        }
+    }
+    for (y=j->mcu_y0; y<j->mcu_y1; y++) {
+        for (i=0; i<j->comp_count; i++) {
+            struct s_jcomp *c = &j->comp[i];
+            const struct s_qt_tbl *qt = j->qtbl[c->qtbl_id];
+            u8 *out = &c->pixels[(y % c->slots) * c->lines * c->stride];
+            int bx0 = j->mcu_x0 * c->h_samp, bx1 = j->mcu_x1 * c->h_samp;
+            STAGE_MARK(j, t);
+            for (by=0; by<c->v_samp; by++) {
+                for (x=bx0; x<bx1; x++) {
+                    const s16 *blk = &c->coef[((y*c->v_samp + by) * c->bw + x) * DCTSIZE2];
+                    for (last=DCTSIZE2-1; last>0 && !(blk[_IZZ[last]] && j->zz_keep[last]); last--);
+                    STAT_ADD(blocks, 1);
+                    STAT_ADD(eob[last], 1);
+                    for (k=0; k<=last; k++)
+                        c->vec[_IZZ[k]] = blk[_IZZ[k]] * qt->q[k] * j->zz_keep[k];
+                    _idct_block(j, c->vec, last, &out[(by*c->stride + x - bx0) * j->bsize], c->stride);
+                }
+            }
+            STAGE_ADD(j, JD_STAGE_IDCT, t);
+        }
+        if (y > j->mcu_y0)
+            _convert_mcu_line(j, y - 1, j->scan_out, j->up_buf);
+    }
+    _convert_mcu_line(j, j->mcu_y1 - 1, j->scan_out, j->up_buf);
+}
+
+// jump over the restart intervals before mcu m without decoding them,
+// gives the first mcu of the interval landed in
+static int
+_seek_restart(struct s_bctx *b, struct s_jctx *j, int m) {
+    int i, n = 0, seg = m / j->restintv, p = b->r_ptr;
+    while (n < seg) {
+        const u8 *q = memchr(&b->r_data[p], 0xff, b->len - p);
+        u8 mk;
+        if (!q || q + 1 >= &b->r_data[b->len])
+            return 0;
+        p = q - b->r_data + 1;
+        mk = b->r_data[p];
+        if (mk == 0x00 || mk == 0xff)
+            continue;
+        if ((mk & 0xf8) != 0xd0)
+            return 0;           /* end of scan, decode from the start */
+        n++;
+        p++;
+    }
+    b->r_ptr = p;
+    _bits_clear(b);
+    j->restintv_next = seg & 0x7;
+    j->restintv_cnt = j->restintv;
+    j->restintv_left -= seg;
+    for (i=0; i<j->comp_count; i++)
+        j->comp[i].dc = 0;
+    STAT_ADD(restarts, seg);
+    return seg * j->restintv;
+}
+
+// baseline scans without usable restart intervals can not be split, this
+// thread entropy decodes mcu lines of quantized coefs into a ring and
+// workers take lines for dequant and idct into whole image comp planes.
+// a line is converted by whichever worker finishes the last of the lines
+// its upsampling reads. ring slots carry a sequence number, t + 1 once
+// line t is in, t + slots once it is taken out
+#define PIPE_WAIT(cond) while ( !(cond) ) sched_yield()
+
+struct s_jpipe {
+    struct s_jctx *j;
+    s16 *coef;                  /* slots of one mcu line of blocks */
+    u8 *last;                   /* zigzag index of each block's last coef */
+    int *seq;
+    int *mcus;                  /* mcus of the line decoded */
+    u8 *done;                   /* mcu lines through idct */
+    u8 *conv;                   /* mcu lines converted or taken to */
+    int slots, line_blocks, lines, near;
+    int take;                   /* next line for the workers */
+};
+
+struct s_jpworker {
+    struct s_jpipe *p;
+    u8 *scan_out;
+    u8 *up_buf;
+    pthread_t tid;
+};
+
+// entropy decode one block, quantized coefs in natural order to blk,
+// gives the zigzag index of the last
+static int
+_decode_coefs(struct s_bctx *b, struct s_jctx *j, struct s_jcomp *c, s16 *blk) {
+    int ai, val, last = 0;
+    const struct s_ht_tbl *htbl = j->htbl[c->ht_ac_id];
+    c->dc += _check_vlc_in_ht(b, j->htbl[c->ht_dc_id], NULL);
+    blk[0] = c->dc;
+    for (ai=1; ai<64; ai++) {
+        u8 code = 0;
+        val = _check_vlc_in_ht(b, htbl, &code);
+        if ( !code ) break;
+        ai += code >> 4;
+        if (ai > 63) break;
+        if ( j->zz_keep[ai] ) {
+            blk[_IZZ[ai]] = val;
+            last = ai;
+        }
+    }
+    STAT_ADD(blocks, 1);
+    STAT_ADD(eob[ai > 64 ? 63 : ai - 1], 1);
+    return last;
+}
+
+// convert line y once lines y - near .. y + near are all through idct
+static void
+_pipe_try_convert(struct s_jpworker *w, int y) {
+    struct s_jpipe *p = w->p;
+    int i, lo = y - p->near, hi = y + p->near;
+    if (y < 0 || y >= p->lines)
+        return;
+    if (lo < 0) lo = 0;
+    if (hi > p->lines - 1) hi = p->lines - 1;
+    for (i=lo; i<=hi; i++)
+        if ( !__atomic_load_n(&p->done[i], __ATOMIC_SEQ_CST) )
+            return;
+    if (__sync_bool_compare_and_swap(&p->conv[y], 0, 1))
+        _convert_mcu_line(p->j, y, w->scan_out, w->up_buf);
+}
 
-    //_dump_buf(c->pixels);
+static void*
+_pipe_worker(void *arg) {
+    struct s_jpworker *w = arg;
+    struct s_jpipe *p = w->p;
+    struct s_jctx *j = p->j;
+    s32 vec[DCTSIZE2] = {0};
+    STAGE_BEGIN();
+    for (;;) {
+        int x, i, k, t = __sync_fetch_and_add(&p->take, 1);
+        int slot = t % p->slots;
+        s16 *blk = &p->coef[(size_t)slot * p->line_blocks * DCTSIZE2];
+        u8 *last = &p->last[slot * p->line_blocks];
+        if (t >= p->lines)
+            break;
+        PIPE_WAIT(__atomic_load_n(&p->seq[slot], __ATOMIC_ACQUIRE) == t + 1);
+        STAGE_MARK(j, ts);
+        for (x=0; x<p->mcus[slot]; x++) {
+            for (i=0; i<j->mcu_blocks; i++, blk+=DCTSIZE2, last++) {
+                struct s_jcomp *c = &j->comp[j->mcu_comp[i]];
+                const u16 *qtbl = j->qtbl[c->qtbl_id]->q;
+                u8 *out = &c->pixels[(size_t)t * c->lines * c->stride];
+                for (k=0; k<=*last; k++) {
+                    vec[_IZZ[k]] = blk[_IZZ[k]] * qtbl[k];
+                    blk[_IZZ[k]] = 0;
+                }
+                _idct_block(j, vec, *last, &out[x*c->h_samp*j->bsize + j->mcu_offset[i]], c->stride);
+            }
+        }
+        STAGE_ADD(j, JD_STAGE_IDCT, ts);
+        __atomic_store_n(&p->seq[slot], t + p->slots, __ATOMIC_RELEASE);
+        __atomic_store_n(&p->done[t], 1, __ATOMIC_SEQ_CST);
+        if (j->pixels || j->planar) {
+            for (i=t-p->near; i<=t+p->near; i++)
+                _pipe_try_convert(w, i);
+        }
+    }
+    STAGE_END(j);
+    return NULL;
+}
+
+int
+_decode_scan_pipe(struct s_bctx *b, struct s_jctx *j) {
+    int i, n, x, y, nthread = j->threads - 1, slots = nthread * 2 + 2;
+    int line_blocks = j->h_mcus * j->mcu_blocks;
+    int line_buf = j->scan_len + j->out_w * 2;
+    size_t ring = (size_t)slots * line_blocks * DCTSIZE2 * sizeof(s16);
+    struct s_jpipe p;
+    struct s_jpworker *w;
+    u8 *q;
+    if (j->mcu_x0 || j->mcu_y0 || j->mcu_y1 < j->v_mcus)
+        return 0;
+    p.coef = _arena_alloc(&j->arena, ring);
+    q = _arena_alloc(&j->arena, sizeof(int) * slots * 2 + slots * line_blocks + j->v_mcus * 2);
+    w = _arena_alloc(&j->arena, (sizeof(*w) + line_buf) * nthread);
+    if (!p.coef || !q || !w)
+        return 0;
+    for (i=0; i<j->comp_count; i++) {
+        struct s_jcomp *c = &j->comp[i];
+        if (c->slots < j->v_mcus) {
+            u8 *px = _arena_alloc(&j->arena, (size_t)c->stride * c->lines * j->v_mcus);
+            if ( !px ) return 0;
+            c->pixels = px;
+            c->slots = j->v_mcus;
+        }
+    }
+    memset(p.coef, 0, ring);
+    p.j = j;
+    p.seq = (int*)q;
+    p.mcus = p.seq + slots;
+    p.last = (u8*)(p.mcus + slots);
+    p.done = p.last + slots * line_blocks;
+    p.conv = p.done + j->v_mcus;
+    memset(p.done, 0, j->v_mcus * 2);
+    for (i=0; i<slots; i++)
+        p.seq[i] = i;
+    p.slots = slots;
+    p.line_blocks = line_blocks;
+    p.lines = j->v_mcus;
+    p.near = 0;
+    for (i=1; i<j->comp_count; i++)
+        if (j->comp[i].v_up > 1)
+            p.near = 1;    /* upsampling reads the lines around */
+    p.take = 0;
+    _log(D_COEFF, "\tpipeline %d mcu lines to %d threads\n", p.lines, nthread);
+    for (i=0, n=0; i<nthread; i++) {
+        u8 *lines = (u8*)&w[nthread] + line_buf * n;
+        w[n].p = &p;
+        w[n].scan_out = lines;
+        w[n].up_buf = lines + j->scan_len;
+        if (pthread_create(&w[n].tid, NULL, _pipe_worker, &w[n]) == 0)
+            n++;
+    }
+    if ( !n ) {
+        // planes hold the whole image now, the one thread loop takes them
+        _log(D_INFO, "# No pipeline thread started, decode in one thread #\n");
+        return 0;
+    }
+    for (y=0; y<p.lines; y++) {
+        int slot = y % slots;
+        s16 *blk = &p.coef[(size_t)slot * line_blocks * DCTSIZE2];
+        u8 *last = &p.last[slot * line_blocks];
+        PIPE_WAIT(__atomic_load_n(&p.seq[slot], __ATOMIC_ACQUIRE) == y);
+        STAGE_MARK(j, t);
+        for (x=0; x<j->h_mcus; x++) {
+            for (i=0; i<j->mcu_blocks; i++, blk+=DCTSIZE2)
+                *last++ = _decode_coefs(b, j, &j->comp[j->mcu_comp[i]], blk);
+            if (j->restintv && !(--j->restintv_cnt) && !_decode_restart(b, j)) {
+                x++;
+                break;
+            }
+        }
+        STAGE_ADD(j, JD_STAGE_ENTROPY, t);
+        p.mcus[slot] = x;
+        __atomic_store_n(&p.seq[slot], y + 1, __ATOMIC_RELEASE);
+    }
+    for (i=0; i<n; i++)
+        pthread_join(w[i].tid, NULL);
+    if (!j->pixels && !j->planar) {
+        // the sink takes lines in order
+        for (y=0; y<p.lines; y++)
+            _convert_mcu_line(j, y, j->scan_out, j->up_buf);
+    }
+    return 1;
+}
+
+// every block's quantized coefs into the whole image coef, for jd_transform
+static void
+_decode_scan_coefs(struct s_bctx *b, struct s_jctx *j) {
+    int i, x, y, bx, by;
+    for (y=0; y<j->v_mcus; y++) {
+        for (x=0; x<j->h_mcus; x++) {
+            for (i=0; i<j->comp_count; i++) {
+                struct s_jcomp *c = &j->comp[i];
+                for (by=0; by<c->v_samp; by++)
+                    for (bx=0; bx<c->h_samp; bx++)
+                        _decode_coefs(b, j, c, &c->coef[((y*c->v_samp + by) * c->bw + x*c->h_samp + bx) * DCTSIZE2]);
+            }
+            if (j->restintv && !(--j->restintv_cnt) && !_decode_restart(b, j))
+                return;
+        }
+    }
+}
+
+// tables and output steps of each block of the mcu for this scan
+static void
+_plan_mcu(struct s_jctx *j) {
+    int i;
+    for (i=0; i<j->mcu_blocks; i++) {
+        struct s_mcu_blk *k = &j->mcu_blk[i];
+        struct s_jcomp *c = &j->comp[j->mcu_comp[i]];
+        k->c = c;
+        k->dc = j->htbl[c->ht_dc_id];
+        k->ac = j->htbl[c->ht_ac_id];
+        k->q = j->qtbl[c->qtbl_id]->q;
+        k->offset = j->mcu_offset[i];
+        k->step = c->h_samp * j->bsize;
+        _log(D_VERBOSE, "mcu block %d, comp %d, qtbl_id:%d ht_dc:%d ht_ac:%d\n",
+             i, c->id, c->qtbl_id, c->ht_dc_id, c->ht_ac_id);
+    }
+}
+
+// entropy decode mcus x..x1-1 only, 0 if a restart marker was missing
+static int
+_skip_mcus(struct s_bctx *b, struct s_jctx *j, int x, int x1) {
+    for (; x<x1; x++) {
+        _skip_mcu(b, j);
+        if (j->restintv && !(--j->restintv_cnt) && !_decode_restart(b, j))
+            return 0;
+    }
+    return 1;
+}
+
+// decode mcus x..x1-1 of line y. the callers below give blocks and rst
+// as constants, one function per mcu layout and restart or not, so the
+// block loop unrolls and the tables of each block stay in registers.
+// 0 if a restart marker was missing
+static inline __attribute__((always_inline)) int
+_decode_mcus(struct s_bctx *b, struct s_jctx *j, int y, int x, int x1,
+             const int blocks, const int rst) {
+    struct s_mcu_blk k[MCU_MAX_BLOCKS];
+    u8 *out[MCU_MAX_BLOCKS];
+    int i;
+    for (i=0; i<blocks; i++) {
+        struct s_jcomp *c = j->mcu_blk[i].c;
+        k[i] = j->mcu_blk[i];
+        out[i] = &c->pixels[(size_t)(y % c->slots) * c->lines * c->stride
+                            + (x - j->mcu_x0) * k[i].step + k[i].offset];
+    }
+    for (; x<x1; x++) {
+        for (i=0; i<blocks; i++) {
+            _decode_block(b, j, &k[i], k[i].c, out[i]);
+            out[i] += k[i].step;
+        }
+        // restart every comp's dc
+        if (rst && !(--j->restintv_cnt) && !_decode_restart(b, j))
+            return 0;
+    }
+    return 1;
+}
+
+typedef int (*decode_mcus_fn)(struct s_bctx *b, struct s_jctx *j, int y, int x, int x1);
+
+// gray, 4:4:4, 4:2:2 or 4:4:0, 4:2:0, each with and without restarts
+#define DECODE_MCUS(n)                                                          \
+static int                                                                      \
+_decode_mcus_##n(struct s_bctx *b, struct s_jctx *j, int y, int x, int x1) {   \
+    return _decode_mcus(b, j, y, x, x1, n, 0);                                  \
+}                                                                               \
+static int                                                                      \
+_decode_mcus_##n##r(struct s_bctx *b, struct s_jctx *j, int y, int x, int x1) { \
+    return _decode_mcus(b, j, y, x, x1, n, 1);                                  \
+}
+DECODE_MCUS(1)
+DECODE_MCUS(3)
+DECODE_MCUS(4)
+DECODE_MCUS(6)
+#undef DECODE_MCUS
+
+// other layouts
+static int
+_decode_mcus_any(struct s_bctx *b, struct s_jctx *j, int y, int x, int x1) {
+    return _decode_mcus(b, j, y, x, x1, j->mcu_blocks, j->restintv != 0);
+}
+
+static decode_mcus_fn
+_pick_decode_mcus(const struct s_jctx *j) {
+    int r = j->restintv != 0;
+    switch ( j->mcu_blocks ) {
+        case 1: return r ? _decode_mcus_1r : _decode_mcus_1;
+        case 3: return r ? _decode_mcus_3r : _decode_mcus_3;
+        case 4: return r ? _decode_mcus_4r : _decode_mcus_4;
+        case 6: return r ? _decode_mcus_6r : _decode_mcus_6;
+        default: return _decode_mcus_any;
+    }
 }
 
 void
 _decode_scan(struct s_bctx *b, struct s_jctx *j) {
-    int i;
+    int i, n, scomp[3];
+    u8 ss, se, ahl;
     u16 len = _next_word(b);
     u8 comp = _next_byte(b);
     _log(D_MARKER, "Scan header %d, %d\n", len, comp);
+    if (!j->scan_out || comp < 1 || comp > j->comp_count) {
+        _log(D_ERROR, "# Scan without frame ! #\n");
+        j->err = JD_ERROR;
+        _set_eof(b);
+        return;
+    }
+    if ( !_fill_tables(j) ) {
+        j->err = JD_ENOMEM;
+        _set_eof(b);
+        return;
+    }
     for (i=0; i<comp; i++) {
-        struct s_jcomp *c = &j->comp[i];
         u8 id = _next_byte(b);
         u8 buf = _next_byte(b);
-        c->ht_dc_id = buf >> 4;
-        c->ht_ac_id = (buf & 1) | 2;
-        _log(D_COEFF, "\tcomp id %d, dc:%d, ac:%d\n", id, c->ht_dc_id, c->ht_ac_id);
+        for (n=0; n<j->comp_count-1 && j->comp[n].id!=id; n++);
+        scomp[i] = n;
+        j->comp[n].ht_dc_id = (buf >> 4) & 1;
+        j->comp[n].ht_ac_id = (buf & 1) | 2;
+        _log(D_COEFF, "\tcomp id %d, dc:%d, ac:%d\n", id, j->comp[n].ht_dc_id, j->comp[n].ht_ac_id);
+        if ( !j->qtbl[j->comp[n].qtbl_id] ) {
+            _log(D_ERROR, "# Quantization table %d undefined ! #\n", j->comp[n].qtbl_id);
+            j->err = JD_ERROR;
+            _set_eof(b);
+            return;
+        }
     }
-    {
-        u8 ss = _next_byte(b);
-        u8 se = _next_byte(b);
-        u8 buf = _next_byte(b);
-        _log(D_COEFF, "\tss %d, se %d, ah ai %x\n", ss, se, buf);
-        assert(se==63);
+    ss = _next_byte(b);
+    se = _next_byte(b);
+    ahl = _next_byte(b);
+    _log(D_COEFF, "\tss %d, se %d, ah ai %x\n", ss, se, ahl);
+    _bits_clear(b);
+#ifdef JD_STATS
+    if (j->stats.scans <= JD_MAX_SCANS) {
+        struct s_jscan *sc = &j->stats.scan[j->stats.scans - 1];
+        sc->comps = comp;
+        sc->ss = ss;
+        sc->se = se;
+        sc->ah = ahl >> 4;
+        sc->al = ahl & 0xf;
+    }
+#endif
+    j->idct = j->scale == 0 ? _idct_8x8 : j->scale == 1 ? _idct_4x4 : j->scale == 2 ? _idct_2x2 : _idct_1x1;
+    if ( j->progressive ) {
+        _decode_scan_prog(b, j, comp, scomp, ss, se, ahl >> 4, ahl & 0xf);
+        return;
+    }
+    if (ss != 0 || se != 63) {
+        _log(D_ERROR, "# Bad baseline scan %d..%d ! #\n", ss, se);
+        j->err = JD_ERROR;
+        _set_eof(b);
+        return;
+    }
+    _restart_left(j, j->h_mcus * j->v_mcus);
+    if ( j->xform ) {
+        _decode_scan_coefs(b, j);
+        return;
+    }
+    _plan_mcu(j);
+    if (j->threads > 1 && j->out_w == j->width && j->out_h == j->height) {
+        if (j->restintv && _decode_scan_mt(b, j))
+            return;
+        if (_decode_scan_pipe(b, j))
+            return;
     }
     {
-        int x, y;
-        for (y=0; y<j->v_mcus; y++) {
-            for (x=0; x<j->h_mcus; x++) {
-                // decode MCU
-                for (i=0; i<j->mcu_blocks; i++) {
-                    _decode_block(b, j, i);
-                }
-                switch ( j->mcu_blocks ) {
-                    case 1: _grayscale_convert_mcu( j, x ); break;
-                    case 3: _h1v1_convert_mcu( j, x ); break; // YUV to RGB
-                }
-
-                // restart every comp's dc
-                if (j->restintv && !(--j->restintv_cnt)) {
-                    u16 RSTx = _next_word(b);
-                    _bits_clear(b);
-                    if (RSTx == M_EOI) {
-                        _skip_bytes(b, -2);
-                        goto end_scan_line;
-                    }
-                    _log(D_VERBOSE, "RST meets %4x, %04x\n", RSTx, j->restintv_next);
-                    if (((RSTx&0xfff8)!=0xffd0) || ((RSTx&0x7)!=j->restintv_next)) {
-                        _dump_buf(_get_ptr(b), DCTSIZE);
-                        assert(0);
-                    }
-                    j->restintv_next = (RSTx + 1) & 0x7;
-                    j->restintv_cnt = j->restintv;
-                    for (i=0; i<j->comp_count; i++) {
-                        j->comp[i].dc = 0;
-                    }
-                }
-            }
-        end_scan_line:
-            memcpy(&j->pixels[y*j->scan_len], j->scan_out, j->scan_len);
+        // mcu line is converted after the next one is decoded, upsampling
+        // needs chroma rows on both sides. outside the crop mcus are only
+        // entropy decoded, or jumped over a restart interval at a time. a
+        // missing restart marker gives up the rest of the line
+        decode_mcus_fn decode_mcus = _pick_decode_mcus(j);
+        int x, y, m = 0;
+        if (j->restintv && (j->mcu_y0 || j->mcu_x0))
+            m = _seek_restart(b, j, j->mcu_y0 * j->h_mcus + j->mcu_x0);
+        for (y=m/j->h_mcus, x=m%j->h_mcus; y<j->mcu_y1; y++, x=0) {
+            int x0 = y >= j->mcu_y0 ? j->mcu_x0 : j->h_mcus;
+            int x1 = y >= j->mcu_y0 ? j->mcu_x1 : j->h_mcus;
+            if (_skip_mcus(b, j, x, x0) && decode_mcus(b, j, y, x0, x1))
+                _skip_mcus(b, j, x1, j->h_mcus);
+            if (y > j->mcu_y0)
+                _convert_mcu_line(j, y - 1, j->scan_out, j->up_buf);
         }
+        _convert_mcu_line(j, j->mcu_y1 - 1, j->scan_out, j->up_buf);
+        if (j->mcu_y1 < j->v_mcus)
+            _set_eof(b);        /* nothing below the crop is needed */
     }
 }
 
@@ -741,24 +2843,56 @@ _skip_segment(struct s_bctx *b) {
 
 
 
+#ifdef JD_STATS
+static double
+_stat_ns(struct s_jctx *j) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - j->stats_t0.tv_sec) * 1e9 + (t.tv_nsec - j->stats_t0.tv_nsec);
+}
+
+static void
+_stat_scan_begin(struct s_jctx *j) {
+    if (++j->stats.scans <= JD_MAX_SCANS)
+        j->stats.scan[j->stats.scans - 1].start_ns = _stat_ns(j);
+}
+
+static void
+_stat_scan_end(struct s_jctx *j) {
+    if (j->stats.scans <= JD_MAX_SCANS)
+        j->stats.scan[j->stats.scans - 1].end_ns = _stat_ns(j);
+}
+#else
+#define _stat_scan_begin(j) do {} while (0)
+#define _stat_scan_end(j) do {} while (0)
+#endif
+
 int
 _decode(struct s_bctx *b, struct s_jctx *j) {
     while ( !_is_eof(b) ) {
         u16 marker = _next_word(b);
+        STAGE_MARK(j, t);
         switch ( marker ) {
             case M_SOI: _log(D_MARKER, "SOI\n"); break;
-            case M_EOI: _log(D_MARKER, "EOI\n"); break;
+            case M_EOI: _log(D_MARKER, "EOI\n"); _set_eof(b); break;
             case M_DQT: _get_qt_table(b, j); break;
             case M_SOF0: _decode_frame(b, j); break;
+            case M_SOF2: j->progressive = 1; _decode_frame(b, j); break;
             case M_DRI: _decode_dri(b, j); break;
             case M_DHT: _get_ht_table(b, j); break;
-            case M_SOS: _decode_scan(b, j); break;
+            case M_SOS:
+                _stat_scan_begin(j);
+                _decode_scan(b, j);
+                _stat_scan_end(j);
+                break;
             default:
                 if (marker>=M_APP0 && marker<=M_APPn) {
-                    _log(D_MARKER, "APP segment length %d\n", _skip_segment(b));
+                    int len = _skip_segment(b);
+                    _log(D_MARKER, "APP segment length %d\n", len);
                 }
                 else if (marker == M_COM) {
-                    _log(D_MARKER, "COM segment length %d\n", _skip_segment(b));
+                    int len = _skip_segment(b);
+                    _log(D_MARKER, "COM segment length %d\n", len);
                 }
                 else {
                     _log(D_ERROR, "# Unknow marker %x ! #\n", marker);
@@ -766,37 +2900,763 @@ _decode(struct s_bctx *b, struct s_jctx *j) {
                 }
                 break;
         }
+        if (marker != M_SOS)
+            STAGE_ADD(j, JD_STAGE_PARSE, t);
+    }
+    if (j->progressive && j->coef && j->idct && !j->err && !j->xform) {
+        _finish_prog(j);
     }
     return 1;
 }
 
-int
-main(int argc, char *argv[])
-{
-    long length = 0;
-    u8 *content = NULL;
+// EXIF, TIFF header after "Exif\0\0". IFD0 has the orientation and links
+// to IFD1 whose JPEGInterchangeFormat tags give the thumbnail from the
+// TIFF header
+static u32
+_exif_get(const u8 *p, int n, int le) {
+    u32 v = 0;
+    int i;
+    for (i=0; i<n; i++)
+        v = le ? v | (u32)p[i] << (8*i) : v << 8 | p[i];
+    return v;
+}
 
-    if (argc != 2) {
-        _log(D_INFO, "%s FILE.JPG\n", argv[0]);
+static int
+_exif_thumbnail(const u8 *p, u32 len, u32 *offset, u32 *size, int *orientation) {
+    u32 i, n, ifd, to = 0, tl = 0;
+    int le;
+    if (len < 14 || memcmp(p, "Exif\0\0", 6))
+        return 0;
+    p += 6;
+    len -= 6;
+    if (p[0] == 'I' && p[1] == 'I') le = 1;
+    else if (p[0] == 'M' && p[1] == 'M') le = 0;
+    else return 0;
+    ifd = _exif_get(p + 4, 4, le);
+    if (ifd < 8 || ifd > len - 2)
+        return 0;
+    n = _exif_get(p + ifd, 2, le);
+    if (n * 12 + 6 > len - ifd)
+        return 0;
+    for (i=0; i<n; i++) {
+        const u8 *e = p + ifd + 2 + i * 12;
+        if (_exif_get(e, 2, le) == 0x112)
+            *orientation = _exif_get(e + 8, 2, le);
+    }
+    ifd = _exif_get(p + ifd + 2 + n * 12, 4, le);      /* IFD1 */
+    if (ifd < 8 || ifd > len - 2)
+        return 0;
+    n = _exif_get(p + ifd, 2, le);
+    if (n * 12 + 2 > len - ifd)
         return 0;
+    for (i=0; i<n; i++) {
+        const u8 *e = p + ifd + 2 + i * 12;
+        u32 tag = _exif_get(e, 2, le);
+        u32 v = _exif_get(e + 2, 2, le) == 3 ? _exif_get(e + 8, 2, le) : _exif_get(e + 8, 4, le);
+        if (tag == 0x201) to = v;
+        else if (tag == 0x202) tl = v;
     }
+    if (!to || !tl || to > len || tl > len - to)
+        return 0;
+    *offset = 6 + to;
+    *size = tl;
+    return 1;
+}
 
-    if ( _get_file_content( argv[1], &content, &length ) ) {
-        struct s_bctx *b = _create_bctx( content, (u32)length );
-        struct s_jctx *j = _create_jctx();
+int
+jd_probe(const unsigned char *data, size_t len, struct s_jprobe *pr) {
+    struct s_bctx b;
+    int frame = 0, ret = JD_ERROR;      /* JD_OK once a frame we take is met */
+    memset(pr, 0, sizeof(*pr));
+    if (len > JD_MAX_INPUT)
+        return JD_ERROR;
+    _init_bctx(&b, data, (int)len);
+    if (_next_word(&b) != M_SOI)
+        return JD_ERROR;
+    pr->marker[pr->markers++].marker = M_SOI;
+    while ( !_is_eof(&b) ) {
+        int i, at = _get_offset(&b), seg;
+        u16 marker = _next_word(&b);
+        if ((marker >> 8) != 0xff)
+            return ret;
+        if (marker == 0xffff) {     /* fill byte */
+            _skip_bytes(&b, -1);
+            continue;
+        }
+        seg = _next_word(&b);
+        if (pr->markers < JD_MAX_MARKERS) {
+            pr->marker[pr->markers].marker = marker;
+            pr->marker[pr->markers].offset = at;
+            pr->marker[pr->markers].length = seg;
+        }
+        pr->markers++;
+        if (seg < 2 || (size_t)at + 2 + seg > len)
+            return ret;
+        if (marker == M_DRI) {
+            pr->restart_interval = _next_word(&b);
+        }
+        else if (marker == M_APP0 + 1 && !pr->thumb_len) {
+            u32 off, size;
+            if (_exif_thumbnail(&data[at + 4], seg - 2, &off, &size, &pr->orientation)) {
+                pr->thumb_offset = at + 4 + off;
+                pr->thumb_len = size;
+            }
+        }
+        else if ((marker & 0xfff0) == 0xffc0 && marker != M_DHT && marker != 0xffc8 && marker != 0xffcc
+                 && !frame) {
+            // SOFn, tables and DRI may still follow up to the scan
+            frame = 1;
+            _next_byte(&b);     /* precision */
+            pr->height = _next_word(&b);
+            pr->width = _next_word(&b);
+            pr->comps = _next_byte(&b);
+            pr->progressive = marker == M_SOF2;
+            for (i=0; i<pr->comps && i<4; i++) {
+                u8 buf;
+                _next_byte(&b);
+                buf = _next_byte(&b);
+                _next_byte(&b);
+                pr->h_samp[i] = buf >> 4;
+                pr->v_samp[i] = buf & 0xf;
+            }
+            // what _decode_frame takes
+            ret = JD_OK;
+            if ((marker != M_SOF0 && marker != M_SOF2) || _is_eof(&b)
+                || !pr->width || !pr->height || (pr->comps != 1 && pr->comps != 3))
+                ret = JD_ERROR;
+            for (i=0; i<pr->comps && i<4; i++) {
+                if (pr->h_samp[i] < 1 || pr->h_samp[i] > 2 || pr->v_samp[i] < 1 || pr->v_samp[i] > 2)
+                    ret = JD_ERROR;
+                if (pr->comps > 1 && (pr->h_samp[i] > pr->h_samp[0] || pr->v_samp[i] > pr->v_samp[0]))
+                    ret = JD_ERROR;
+            }
+        }
+        else if (marker == M_SOS || marker == M_EOI) {
+            return ret;         /* headers end at the first scan */
+        }
+        b.r_ptr = at + 2 + seg;
+    }
+    return ret;
+}
 
-        // decoder will malloc buffer in j->pixles
-        if ( _decode(b, j) ) {
-            _save_to_ppm( j ); 
+// segments are stepped over by their length, entropy coded data up to
+// the next 0xff that is not stuffing or a restart marker
+int
+jd_find_frame(const unsigned char *data, size_t len, size_t *start, size_t *end) {
+    const u8 *q = len ? memchr(data, 0xff, len) : NULL;
+    size_t p;
+    *start = len && data[len - 1] == 0xff ? len - 1 : len;
+    for (; q && (size_t)(q - data) + 1 < len; q = memchr(q + 1, 0xff, len - (q + 1 - data))) {
+        if (q[1] == (M_SOI & 0xff))
+            break;
+    }
+    if (!q || (size_t)(q - data) + 1 >= len)
+        return JD_ERROR;        /* no SOI yet */
+    *start = q - data;
+    p = *start + 2;
+    for (;;) {
+        u8 m;
+        if (p < len && data[p] != 0xff) {
+            q = memchr(data + p, 0xff, len - p);
+            p = q ? (size_t)(q - data) : len;
+        }
+        if (p + 1 >= len)
+            return JD_ERROR;
+        m = data[p + 1];
+        if (m == 0xff) {                        /* fill byte */
+            p++;
+        }
+        else if (m == 0 || (m >= 0xd0 && m <= 0xd7)) {
+            p += 2;                             /* stuffed 0xff or RSTn */
+        }
+        else if (m == (M_EOI & 0xff)) {
+            *end = p + 2;
+            return JD_OK;
+        }
+        else if (m == (M_SOI & 0xff)) {
+            *start = p;                         /* the last frame was cut short */
+            p += 2;
         }
         else {
-            _log(D_ERROR, "Fail to decode !!!\n");
+            size_t seg;
+            if (p + 4 > len)
+                return JD_ERROR;
+            seg = data[p + 2] << 8 | data[p + 3];
+            p += 2 + (seg < 2 ? 0 : seg);
+        }
+    }
+}
+
+// lossless transforms. the coefs of the source blocks are moved in the
+// DCT domain: a transposed block is the transposed coefs, a mirrored one
+// flips the sign of its odd horizontal or vertical frequencies. the
+// output is one baseline scan with the source DQT (transposed along) and
+// DHT when those code every symbol, the Annex K tables otherwise
+struct s_xform {
+    int t;                      /* transpose */
+    int mx, my;                 /* then mirror output x, y */
+};
+
+static const struct s_xform _XFORMS[JD_XFORMS] = {
+    { 0, 0, 0 },                /* JD_XFORM_NONE */
+    { 0, 1, 0 },                /* JD_XFORM_FLIP_H */
+    { 0, 1, 1 },                /* JD_XFORM_ROT_180 */
+    { 0, 0, 1 },                /* JD_XFORM_FLIP_V */
+    { 1, 0, 0 },                /* JD_XFORM_TRANSPOSE */
+    { 1, 1, 0 },                /* JD_XFORM_ROT_90 */
+    { 1, 1, 1 },                /* JD_XFORM_TRANSVERSE */
+    { 1, 0, 1 },                /* JD_XFORM_ROT_270 */
+};
+
+// code and length of each symbol, length 0 for none
+struct s_ht_enc {
+    u8 bits[16];
+    u8 vals[256];
+    int count;
+    u16 code[256];
+    u8 size[256];
+};
+
+// output of a transform
+struct s_xout {
+    const struct s_xform *x;
+    int mx0, my0;               /* source mcu it starts at */
+    int w, h;
+    int mcus_x, mcus_y;
+    u8 zz_src[DCTSIZE2];        /* source coef of each output zigzag index, */
+    s16 zz_neg[DCTSIZE2];       /* -1 where its sign flips */
+    struct s_ht_enc ht[4];      /* DC 0 1, AC 0 1 */
+    int ht_id[3][2];            /* DC and AC table of each comp */
+};
+
+struct s_jenc {
+    u8 *out;
+    size_t cap;
+    size_t len;                 /* counts on past cap */
+    u64 acc;
+    int bits;
+    int missing;                /* a symbol without a code was met */
+};
+
+static void
+_ht_enc_build(struct s_ht_enc *h, const u8 *bits, const u8 *vals) {
+    int n, i, k = 0, code = 0;
+    memset(h->size, 0, sizeof(h->size));
+    memcpy(h->bits, bits, 16);
+    for (n=0; n<16; n++) {
+        for (i=0; i<bits[n]; i++, k++) {
+            h->vals[k] = vals[k];
+            h->code[vals[k]] = code++;
+            h->size[vals[k]] = n + 1;
+        }
+        code <<= 1;
+    }
+    h->count = k;
+}
+
+// the table DHT gave, 0 if none did
+static int
+_ht_enc_parsed(struct s_jctx *j, int idx, struct s_ht_enc *h) {
+    const struct s_ht_tbl *ht = j->htbl[idx];
+    u8 bits[16], vals[256];
+    int n, i, k = 0;
+    if (!ht || !ht->count)
+        return 0;
+    for (n=0; n<16; n++) {
+        bits[n] = ht->ary[n].count;
+        for (i=0; i<bits[n]; i++)
+            vals[k++] = ht->ary[n].v[i].code;
+    }
+    _ht_enc_build(h, bits, vals);
+    return 1;
+}
+
+static inline void
+_enc_byte(struct s_jenc *e, u8 v) {
+    if (e->len < e->cap)
+        e->out[e->len] = v;
+    e->len++;
+}
+
+static void
+_enc_word(struct s_jenc *e, u16 v) {
+    _enc_byte(e, v >> 8);
+    _enc_byte(e, v & 0xff);
+}
+
+// bits go out a whole 32 at a time, 0xff stuffed
+static inline void
+_enc_bits(struct s_jenc *e, u32 v, int n) {
+    e->acc = (e->acc << n) | (v & ((1u << n) - 1));
+    e->bits += n;
+    if (e->bits >= 32) {
+        u32 w = e->acc >> (e->bits - 32);
+        int k;
+        e->bits -= 32;
+        if (e->len + 4 <= e->cap && ((~w - 0x01010101u) & w & 0x80808080u) == 0) {
+            e->out[e->len++] = w >> 24;     /* no 0xff byte */
+            e->out[e->len++] = w >> 16;
+            e->out[e->len++] = w >> 8;
+            e->out[e->len++] = w;
+            return;
+        }
+        for (k=24; k>=0; k-=8) {
+            u8 c = w >> k;
+            _enc_byte(e, c);
+            if (c == 0xff)
+                _enc_byte(e, 0);
+        }
+    }
+}
+
+// what is left of the last word, padded with 1s
+static void
+_enc_flush(struct s_jenc *e) {
+    while (e->bits > 0) {
+        int n = e->bits < 8 ? e->bits : 8;
+        u8 c = (e->acc >> (e->bits - n)) << (8 - n) | (0xff >> n);
+        _enc_byte(e, c);
+        if (c == 0xff)
+            _enc_byte(e, 0);
+        e->bits -= n;
+    }
+}
+
+static inline void
+_enc_symbol(struct s_jenc *e, const struct s_ht_enc *h, int sym) {
+    e->missing |= !h->size[sym];
+    _enc_bits(e, h->code[sym], h->size[sym]);
+}
+
+// symbol of the magnitude category, then the value bits. gives the value
+// coded, clamped to the baseline range for corrupt sources
+static inline int
+_enc_value(struct s_jenc *e, const struct s_ht_enc *h, int run, int v, int max) {
+    int n, a = v < 0 ? -v : v;
+    if (a > max)
+        a = max;
+    v = v < 0 ? -a : a;
+    n = a ? 32 - __builtin_clz(a) : 0;
+    _enc_symbol(e, h, (run << 4) | n);
+    if ( n )
+        _enc_bits(e, v < 0 ? v - 1 : v, n);
+    return v;
+}
+
+// source block src through the zigzag order and sign flips of xo, NULL
+// for a block past the source
+static void
+_enc_block(struct s_jenc *e, const struct s_xout *xo, const s16 *src, int *pred,
+           const struct s_ht_enc *dc, const struct s_ht_enc *ac) {
+    int k, run = 0;
+    if ( !src ) {
+        *pred += _enc_value(e, dc, 0, -*pred, 2047);
+        _enc_symbol(e, ac, 0x00);
+        return;
+    }
+    *pred += _enc_value(e, dc, 0, src[0] - *pred, 2047);
+    for (k=1; k<DCTSIZE2; k++) {
+        int v = src[xo->zz_src[k]];
+        if ( !v ) {
+            run++;
+            continue;
+        }
+        v = (v ^ xo->zz_neg[k]) - xo->zz_neg[k];
+        for (; run>15; run-=16)
+            _enc_symbol(e, ac, 0xf0);       /* ZRL */
+        _enc_value(e, ac, run, v, 1023);
+        run = 0;
+    }
+    if ( run )
+        _enc_symbol(e, ac, 0x00);           /* EOB */
+}
+
+// the source block of output block ox, oy of comp c, obw x obh blocks of
+// it, NULL past the source
+static const s16*
+_xform_block(const struct s_jcomp *c, const struct s_xout *xo, int obw, int obh,
+             int ox, int oy) {
+    const struct s_xform *x = xo->x;
+    int px = x->mx ? obw - 1 - ox : ox, py = x->my ? obh - 1 - oy : oy;
+    int sx = xo->mx0 * c->h_samp + (x->t ? py : px);
+    int sy = xo->my0 * c->v_samp + (x->t ? px : py);
+    if (sx >= c->bw || sy >= c->bh)
+        return NULL;
+    return c->coef + ((size_t)sy * c->bw + sx) * DCTSIZE2;
+}
+
+// output size and where it starts, a rectangle from the mcu holding its
+// top left corner with crop. a mirrored edge must be whole mcus, the
+// partial one is dropped
+static int
+_xform_geometry(struct s_jctx *j, struct s_xout *xo) {
+    const struct s_xform *x = xo->x;
+    int mw = j->comp[0].h_samp * DCTSIZE, mh = j->comp[0].v_samp * DCTSIZE;
+    int w = j->width, h = j->height;
+    xo->mx0 = xo->my0 = 0;
+    if (j->crop_w > 0 && j->crop_h > 0) {
+        int x1 = j->crop_x + j->crop_w, y1 = j->crop_y + j->crop_h;
+        xo->mx0 = j->crop_x > 0 ? j->crop_x / mw : 0;
+        xo->my0 = j->crop_y > 0 ? j->crop_y / mh : 0;
+        w = (x1 < w ? x1 : w) - xo->mx0 * mw;
+        h = (y1 < h ? y1 : h) - xo->my0 * mh;
+    }
+    if (x->t ? x->my : x->mx) w = w / mw * mw;
+    if (x->t ? x->mx : x->my) h = h / mh * mh;
+    if (w <= 0 || h <= 0)
+        return 0;
+    xo->w = x->t ? h : w;
+    xo->h = x->t ? w : h;
+    xo->mcus_x = (xo->w + (x->t ? mh : mw) - 1) / (x->t ? mh : mw);
+    xo->mcus_y = (xo->h + (x->t ? mw : mh) - 1) / (x->t ? mw : mh);
+    return 1;
+}
+
+static void
+_xform_scan(struct s_jctx *j, struct s_xout *xo, struct s_jenc *e) {
+    int i, mx, my, bx, by, pred[3] = {0, 0, 0};
+    for (my=0; my<xo->mcus_y; my++) {
+        for (mx=0; mx<xo->mcus_x; mx++) {
+            for (i=0; i<j->comp_count; i++) {
+                const struct s_jcomp *c = &j->comp[i];
+                int hs = xo->x->t ? c->v_samp : c->h_samp;
+                int vs = xo->x->t ? c->h_samp : c->v_samp;
+                for (by=0; by<vs; by++) {
+                    for (bx=0; bx<hs; bx++) {
+                        const s16 *src = _xform_block(c, xo, xo->mcus_x * hs, xo->mcus_y * vs,
+                                                      mx * hs + bx, my * vs + by);
+                        // transposed, the next blocks are a row of blocks apart
+                        const s16 *next = mx + 2 >= xo->mcus_x ? NULL :
+                            _xform_block(c, xo, xo->mcus_x * hs, xo->mcus_y * vs,
+                                         (mx + 2) * hs + bx, my * vs + by);
+                        if ( next ) {
+                            __builtin_prefetch(next);
+                            __builtin_prefetch(next + DCTSIZE2 / 2);
+                        }
+                        _enc_block(e, xo, src, &pred[i], &xo->ht[xo->ht_id[i][0]],
+                                   &xo->ht[xo->ht_id[i][1]]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+_xform_headers(struct s_jctx *j, struct s_xout *xo, struct s_jenc *e) {
+    int i, k, t = xo->x->t, qt_done = 0;
+    u8 zz[DCTSIZE2];
+    for (k=0; k<DCTSIZE2; k++)
+        zz[_IZZ[k]] = k;
+    _enc_word(e, M_SOI);
+    for (i=0; i<j->comp_count; i++) {
+        int id = j->comp[i].qtbl_id, wide = 0;
+        const u16 *q = j->qtbl[id]->q;
+        if (qt_done & (1 << id))
+            continue;
+        qt_done |= 1 << id;
+        for (k=0; k<DCTSIZE2; k++)
+            wide |= q[k] > 0xff;
+        _enc_word(e, M_DQT);
+        _enc_word(e, 2 + 1 + (DCTSIZE2 << wide));
+        _enc_byte(e, wide << 4 | id);
+        for (k=0; k<DCTSIZE2; k++) {
+            int n = _IZZ[k], v = q[t ? zz[(n & 7) * DCTSIZE + (n >> 3)] : k];
+            if ( wide )
+                _enc_byte(e, v >> 8);
+            _enc_byte(e, v);
+        }
+    }
+    _enc_word(e, M_SOF0);
+    _enc_word(e, 8 + 3 * j->comp_count);
+    _enc_byte(e, 8);
+    _enc_word(e, xo->h);
+    _enc_word(e, xo->w);
+    _enc_byte(e, j->comp_count);
+    for (i=0; i<j->comp_count; i++) {
+        const struct s_jcomp *c = &j->comp[i];
+        _enc_byte(e, c->id);
+        _enc_byte(e, t ? (c->v_samp << 4 | c->h_samp) : (c->h_samp << 4 | c->v_samp));
+        _enc_byte(e, c->qtbl_id);
+    }
+    for (k=0; k<4; k++) {
+        for (i=0; i<j->comp_count && xo->ht_id[i][0] != k && xo->ht_id[i][1] != k; i++);
+        if (i == j->comp_count)
+            continue;           /* no comp codes with it */
+        _enc_word(e, M_DHT);
+        _enc_word(e, 2 + 1 + 16 + xo->ht[k].count);
+        _enc_byte(e, (k >> 1) << 4 | (k & 1));
+        for (i=0; i<16; i++)
+            _enc_byte(e, xo->ht[k].bits[i]);
+        for (i=0; i<xo->ht[k].count; i++)
+            _enc_byte(e, xo->ht[k].vals[i]);
+    }
+    _enc_word(e, M_SOS);
+    _enc_word(e, 6 + 2 * j->comp_count);
+    _enc_byte(e, j->comp_count);
+    for (i=0; i<j->comp_count; i++) {
+        _enc_byte(e, j->comp[i].id);
+        _enc_byte(e, xo->ht_id[i][0] << 4 | (xo->ht_id[i][1] & 1));
+    }
+    _enc_byte(e, 0);            /* ss, se, ah al */
+    _enc_byte(e, 63);
+    _enc_byte(e, 0);
+}
+
+// the whole image coef of j through transform x to a baseline jpeg
+static int
+_xform_encode(struct s_jctx *j, const struct s_xform *x, struct s_jenc *e) {
+    struct s_xout xo;
+    int i, k;
+    xo.x = x;
+    for (i=0; i<j->comp_count; i++) {
+        if ( !j->qtbl[j->comp[i].qtbl_id] ) {
+            _log(D_ERROR, "# Quantization table %d undefined ! #\n", j->comp[i].qtbl_id);
+            return JD_ERROR;
+        }
+    }
+    if ( !_xform_geometry(j, &xo) ) {
+        _log(D_ERROR, "# Nothing left to transform ! #\n");
+        return JD_ERROR;
+    }
+    for (k=0; k<DCTSIZE2; k++) {
+        int u = _IZZ[k] & 7, v = _IZZ[k] >> 3;
+        xo.zz_src[k] = x->t ? u * DCTSIZE + v : v * DCTSIZE + u;
+        xo.zz_neg[k] = -(((x->mx & u) ^ (x->my & v)) & 1);
+    }
+    // the source tables, unless they miss a symbol of the output. the
+    // Annex K ones code every symbol and are done over with then
+    for (i=0; i<j->comp_count; i++) {
+        xo.ht_id[i][0] = j->comp[i].ht_dc_id;
+        xo.ht_id[i][1] = j->comp[i].ht_ac_id;
+        if (!_ht_enc_parsed(j, xo.ht_id[i][0], &xo.ht[xo.ht_id[i][0]])
+            || !_ht_enc_parsed(j, xo.ht_id[i][1], &xo.ht[xo.ht_id[i][1]]))
+            e->missing = 1;
+    }
+    if ( !e->missing ) {
+        _xform_headers(j, &xo, e);
+        _xform_scan(j, &xo, e);
+    }
+    if ( e->missing ) {
+        _log(D_INFO, "\tsource huffman tables incomplete, Annex K ones\n");
+        for (i=0; i<2; i++) {
+            _ht_enc_build(&xo.ht[i], _STD_DC_BITS[i], _STD_DC_VALS);
+            _ht_enc_build(&xo.ht[2 + i], _STD_AC_BITS[i], _STD_AC_VALS[i]);
+        }
+        for (i=0; i<j->comp_count; i++) {
+            xo.ht_id[i][0] = i > 0;
+            xo.ht_id[i][1] = 2 + (i > 0);
+        }
+        e->len = e->bits = 0;
+        e->acc = 0;
+        _xform_headers(j, &xo, e);
+        _xform_scan(j, &xo, e);
+    }
+    _enc_flush(e);
+    _enc_word(e, M_EOI);
+    j->info.width = xo.w;
+    j->info.height = xo.h;
+    return JD_OK;
+}
+
+static pthread_once_t _dispatch_once = PTHREAD_ONCE_INIT;
+
+struct s_jctx*
+jd_create(void) {
+    pthread_once(&_dispatch_once, _init_dispatch);
+    return _create_jctx();
+}
+
+void
+jd_destroy(struct s_jctx *j) {
+    _destroy_jctx(j);
+}
+
+void
+jd_set_threads(struct s_jctx *j, int threads) {
+    j->threads = threads > 1 ? threads : 1;
+}
+
+void
+jd_set_arena(struct s_jctx *j, void *mem, size_t len) {
+    _arena_release(&j->arena);
+    if ( mem ) {
+        j->arena.base = mem;
+        j->arena.cap = len;
+        j->arena.caller = 1;
+    }
+}
+
+void
+jd_set_crop(struct s_jctx *j, int x, int y, int w, int h) {
+    j->crop_x = x;
+    j->crop_y = y;
+    j->crop_w = w;
+    j->crop_h = h;
+}
+
+void
+jd_set_stream(struct s_jctx *j, int on) {
+    j->stream = on;
+    j->ht_kept = j->qt_kept = 0;
+}
+
+int
+jd_set_scale(struct s_jctx *j, int denom) {
+    int s;
+    for (s=0; s<=3 && (1 << s) != denom; s++);
+    if (s > 3)
+        return JD_ERROR;
+    j->scale = s;
+    return JD_OK;
+}
+
+static int
+_jd_run(struct s_jctx *j, struct s_jinfo *info) {
+    int ok;
+#ifdef JD_STATS
+    clock_gettime(CLOCK_MONOTONIC, &j->stats_t0);
+#endif
+    STAGE_BEGIN();
+    ok = _decode(&j->b, j);
+    STAGE_END(j);
+#ifdef JD_STATS
+    j->stats.bytes = j->b.r_ptr < j->b.len ? j->b.r_ptr : j->b.len;
+#endif
+    if ( info )
+        *info = j->info;
+    if (j->b.r_bad && !j->err)
+        j->err = JD_ERROR;      /* what was decoded is still in the output */
+    if ( j->err )
+        return j->err;
+    if (!ok || !j->idct)        /* no scan decoded */
+        return JD_ERROR;
+    return JD_OK;
+}
+
+const unsigned char*
+jd_map_file(const char *path, size_t *len) {
+    struct stat st;
+    void *p = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+            *len = st.st_size;
         }
+    }
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void
+jd_unmap_file(const unsigned char *data, size_t len) {
+    if ( data )
+        munmap((void*)data, len);
+}
+
+int
+jd_decode(struct s_jctx *j, const unsigned char *data, size_t len,
+          unsigned char *out, size_t out_len, struct s_jinfo *info) {
+    _reset_jctx(j);
+    if (len > JD_MAX_INPUT)
+        return JD_ERROR;
+    _init_bctx(&j->b, data, (int)len);
+    j->pixels = out;
+    j->out_len = out ? out_len : 0;
+    return _jd_run(j, info);
+}
+
+int
+jd_decode_planes(struct s_jctx *j, const unsigned char *data, size_t len,
+                 const struct s_jplanes *planes, struct s_jinfo *info) {
+    _reset_jctx(j);
+    if (len > JD_MAX_INPUT)
+        return JD_ERROR;
+    _init_bctx(&j->b, data, (int)len);
+    j->planar = 1;
+    if ( planes )
+        j->planes = *planes;
+    return _jd_run(j, info);
+}
 
-        _destroy_jctx( j );
-        _destroy_bctx( b );
-        _free_file_content( content );
+int
+jd_decode_thumbnail(struct s_jctx *j, const unsigned char *data, size_t len,
+                    unsigned char *out, size_t out_len, struct s_jinfo *info) {
+    struct s_jprobe pr;
+    jd_probe(data, len, &pr);   /* the main frame may be one we can not decode */
+    if ( !pr.thumb_len )
+        return JD_ERROR;
+    return jd_decode(j, data + pr.thumb_offset, pr.thumb_len, out, out_len, info);
+}
+
+int
+jd_decode_rows(struct s_jctx *j, const unsigned char *data, size_t len,
+               jd_row_cb cb, void *user, struct s_jinfo *info) {
+    if ( !cb )
+        return JD_ERROR;
+    _reset_jctx(j);
+    if (len > JD_MAX_INPUT)
+        return JD_ERROR;
+    _init_bctx(&j->b, data, (int)len);
+    j->row_cb = cb;
+    j->row_user = user;
+    return _jd_run(j, info);
+}
+
+int
+jd_transform(struct s_jctx *j, const unsigned char *data, size_t len, int xform,
+             unsigned char *out, size_t out_len, size_t *out_used) {
+    struct s_jenc e;
+    int ret;
+    if (xform < 0 || xform >= JD_XFORMS)
+        return JD_ERROR;
+    _reset_jctx(j);
+    if (len > JD_MAX_INPUT)
+        return JD_ERROR;
+    _init_bctx(&j->b, data, (int)len);
+    j->xform = 1;
+    ret = _jd_run(j, NULL);
+    if (ret != JD_OK)
+        return ret;
+    memset(&e, 0, sizeof(e));
+    e.out = out;
+    e.cap = out ? out_len : 0;
+    ret = _xform_encode(j, &_XFORMS[xform], &e);
+    if ( out_used )
+        *out_used = e.len;
+    if (ret == JD_OK && e.len > e.cap)
+        ret = JD_ESIZE;
+    return ret;
+}
+
+void
+jd_set_stage_timing(struct s_jctx *j, int on) {
+    j->timing = on;
+}
+
+void
+jd_stage_times(const struct s_jctx *j, double ns[JD_STAGES]) {
+    int i;
+    for (i=0; i<JD_STAGES; i++) {
+#ifdef JD_BENCH
+        ns[i] = j->stage_ticks[i] * _stage_ns_per_tick;
+#else
+        ns[i] = 0;
+#endif
     }
+}
 
-    return 0;
+int
+jd_get_stats(const struct s_jctx *j, struct s_jstats *stats) {
+#ifdef JD_STATS
+    *stats = j->stats;
+    return JD_OK;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return JD_ERROR;
+#endif
 }
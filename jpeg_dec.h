@@ -0,0 +1,253 @@
+// by suchang, 2014/11/22
+
+#ifndef JPEG_DEC_H
+#define JPEG_DEC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define JD_API __attribute__((visibility("default")))
+#else
+#define JD_API
+#endif
+
+enum {
+    JD_OK = 0,
+    JD_ERROR = -1,              /* corrupt or unsupported stream */
+    JD_ESIZE = -2,              /* output buffer too small, see info */
+    JD_ENOMEM = -3,
+};
+
+/*
+ * largest jpeg in memory the decode, probe and transform calls take,
+ * JD_ERROR for a longer one. offsets into it are ints, a segment length
+ * past its end still fits one.
+ */
+#define JD_MAX_INPUT 0x7fff0000
+
+struct s_jinfo {
+    int width;
+    int height;
+    int comps;                  /* 1 gray, 3 rgb, bytes per pixel */
+    int progressive;
+    int plane_w[3];             /* Y, Cb, Cr sizes of planar output, */
+    int plane_h[3];             /* chroma at its own resolution */
+};
+
+/* caller planes for jd_decode_planes, each plane_h rows of plane_w bytes */
+struct s_jplanes {
+    unsigned char *plane[3];
+    int stride[3];
+};
+
+/* decode stages timed in builds with JD_BENCH defined */
+enum {
+    JD_STAGE_PARSE = 0,         /* marker segments but scans */
+    JD_STAGE_ENTROPY,           /* huffman decode of scans */
+    JD_STAGE_IDCT,              /* dequant and idct */
+    JD_STAGE_COLOR,             /* upsampling and color conversion */
+    JD_STAGES,
+};
+
+#define JD_MAX_SCANS 32
+
+struct s_jscan {
+    double start_ns, end_ns;    /* from the start of the decode */
+    int comps;
+    int ss, se, ah, al;         /* spectral band and successive approximation */
+};
+
+/* counters of the last decode, builds with JD_STATS defined */
+struct s_jstats {
+    unsigned long long blocks;          /* blocks through idct */
+    unsigned long long blocks_skipped;  /* entropy decoded only, out of the crop */
+    unsigned long long restarts;        /* restart intervals after the first */
+    unsigned long long bytes;           /* input consumed */
+    unsigned long long eob[64];         /* blocks by zigzag index of the last coef, 0 dc only */
+    int scans;                          /* scan[] holds the first JD_MAX_SCANS */
+    struct s_jscan scan[JD_MAX_SCANS];
+};
+
+#define JD_MAX_MARKERS 32
+
+struct s_jmarker {
+    int marker;                 /* 0xffxx */
+    int offset;                 /* of the 0xff in data */
+    int length;                 /* segment bytes after the marker, 0 for SOI */
+};
+
+/* what jd_probe reads from the markers up to the frame header */
+struct s_jprobe {
+    int width;
+    int height;
+    int comps;
+    int progressive;
+    int h_samp[4];              /* sampling factors of the first 4 comps */
+    int v_samp[4];
+    int restart_interval;       /* DRI before the first scan, 0 none */
+    size_t thumb_offset;        /* EXIF jpeg thumbnail in data, */
+    size_t thumb_len;           /* thumb_len 0 if none */
+    int orientation;            /* EXIF 1..8, 0 none */
+    int markers;                /* segments up to and with the first SOS, */
+    struct s_jmarker marker[JD_MAX_MARKERS];    /* the first JD_MAX_MARKERS */
+};
+
+/* lossless transforms of jd_transform, EXIF orientation n is n - 1 */
+enum {
+    JD_XFORM_NONE = 0,
+    JD_XFORM_FLIP_H,            /* mirror left to right */
+    JD_XFORM_ROT_180,
+    JD_XFORM_FLIP_V,            /* mirror top to bottom */
+    JD_XFORM_TRANSPOSE,         /* across the top left to bottom right diagonal */
+    JD_XFORM_ROT_90,            /* clockwise */
+    JD_XFORM_TRANSVERSE,        /* across the other diagonal */
+    JD_XFORM_ROT_270,
+    JD_XFORMS,
+};
+
+/* decoder handle, one per thread, reused across images */
+struct s_jctx;
+
+/* rows y..y+lines-1 of the image, packed width * comps bytes each */
+typedef void (*jd_row_cb)(void *user, const struct s_jinfo *info,
+                          const unsigned char *rows, int y, int lines);
+
+JD_API struct s_jctx* jd_create(void);
+JD_API void jd_destroy(struct s_jctx *j);
+
+/*
+ * decode one image in threads, 1 by default. restart intervals are
+ * entropy decoded in parallel, other baseline images are entropy decoded
+ * in the calling thread while threads - 1 workers do idct and color.
+ */
+JD_API void jd_set_threads(struct s_jctx *j, int threads);
+
+/* output at 1/denom size, denom 1, 2, 4 or 8, info gives the scaled size */
+JD_API int jd_set_scale(struct s_jctx *j, int denom);
+
+/*
+ * take what each image needs (tables, comp pixels, coefficients, line
+ * buffers) from len bytes at mem instead of the handle's own arena, mem
+ * NULL to go back to it. the handle keeps using mem until then, what does
+ * not fit comes from the heap and is freed when the next image starts.
+ */
+JD_API void jd_set_arena(struct s_jctx *j, void *mem, size_t len);
+
+/*
+ * decode the frames of an MJPEG stream, on or off. a table a frame does
+ * not define is then the last one an earlier frame did. without it, and
+ * before the first, huffman tables no DHT defined are the Annex K ones.
+ */
+JD_API void jd_set_stream(struct s_jctx *j, int on);
+
+/*
+ * output only the x, y, w, h rectangle of the (scaled) image, clipped to
+ * it, w or h 0 for the whole image. info gives the clipped size. mcus out
+ * of the rectangle skip idct and color, restart intervals before it are
+ * jumped over, and decoding stops below it.
+ */
+JD_API void jd_set_crop(struct s_jctx *j, int x, int y, int w, int h);
+
+/*
+ * decode a whole jpeg in memory into out, rows packed top to bottom with
+ * width * comps bytes each, up to its EOI. info is filled once the frame header is read,
+ * so with out NULL or too small JD_ESIZE tells the size to provide.
+ * a scan cut short by truncated or corrupt data gives JD_ERROR, what was
+ * decoded before the break is still in out, the rest left blank.
+ * internal memory is only grown when an image is larger than any before.
+ */
+JD_API int jd_decode(struct s_jctx *j, const unsigned char *data, size_t len,
+                     unsigned char *out, size_t out_len, struct s_jinfo *info);
+
+/*
+ * same, but Y, Cb and Cr go straight into the caller planes without color
+ * conversion or chroma upsampling, plane_w/plane_h of info give their
+ * sizes (only plane 0 for gray). planes NULL gives JD_ESIZE once info is
+ * filled.
+ */
+JD_API int jd_decode_planes(struct s_jctx *j, const unsigned char *data, size_t len,
+                            const struct s_jplanes *planes, struct s_jinfo *info);
+
+/*
+ * walk the segment headers of a jpeg in memory up to its first SOS and
+ * stop there, without a decoder handle or any allocation. JD_ERROR if it is not a
+ * jpeg, or its frame is one jd_decode does not support (probe is still
+ * filled as far as read).
+ */
+JD_API int jd_probe(const unsigned char *data, size_t len, struct s_jprobe *probe);
+
+/*
+ * find the first whole jpeg in a stream of them back to back (MJPEG):
+ * data + start up to data + end is from its SOI through its EOI. JD_ERROR
+ * while its EOI is not in len bytes yet, start then tells where the frame
+ * or what may still start one begins, the bytes before can be dropped.
+ */
+JD_API int jd_find_frame(const unsigned char *data, size_t len, size_t *start, size_t *end);
+
+/*
+ * decode the jpeg thumbnail of the APP1 EXIF segment like jd_decode,
+ * JD_ERROR if there is none. jd_probe gives where it is for other uses,
+ * such as jd_decode_rows on data + thumb_offset.
+ */
+JD_API int jd_decode_thumbnail(struct s_jctx *j, const unsigned char *data, size_t len,
+                               unsigned char *out, size_t out_len, struct s_jinfo *info);
+
+/*
+ * map a file read-only with sequential advice to decode straight from the
+ * page cache, NULL if it can not be mapped. unmap once decoded.
+ */
+JD_API const unsigned char* jd_map_file(const char *path, size_t *len);
+JD_API void jd_unmap_file(const unsigned char *data, size_t len);
+
+/*
+ * same, but hand each mcu line (8 or 16 rows) to cb in order as soon as it
+ * is converted, no frame buffer is needed. baseline without threads keeps
+ * only a few mcu lines; threads and progressive still hold the whole image
+ * in planes or coefficients.
+ */
+JD_API int jd_decode_rows(struct s_jctx *j, const unsigned char *data, size_t len,
+                          jd_row_cb cb, void *user, struct s_jinfo *info);
+
+/*
+ * rotate, flip or crop a jpeg without decoding it to pixels: its blocks
+ * are moved in the DCT domain and entropy coded again into out as one
+ * baseline jpeg, no quality is lost. the DQT and DHT of the source are
+ * kept when they fit, the standard huffman tables are used otherwise, and
+ * markers other than those are not copied. with jd_set_crop the output
+ * starts at the mcu holding the corner of the crop (scale is ignored). an
+ * edge that gets mirrored must be whole mcus, the partial ones are
+ * dropped. out NULL or too small gives JD_ESIZE, out_used always tells
+ * the size of the output.
+ */
+JD_API int jd_transform(struct s_jctx *j, const unsigned char *data, size_t len, int xform,
+                        unsigned char *out, size_t out_len, size_t *out_used);
+
+/*
+ * time each JD_STAGE_xxx of the following decodes, off by default. the
+ * timers are only built in with JD_BENCH and slow decoding down by a
+ * tenth or more, time the whole decode with them off.
+ */
+JD_API void jd_set_stage_timing(struct s_jctx *j, int on);
+
+/*
+ * nanoseconds the last decode spent in each stage, summed over threads,
+ * row callbacks not included. all 0 when not timed.
+ */
+JD_API void jd_stage_times(const struct s_jctx *j, double ns[JD_STAGES]);
+
+/*
+ * counters and scan times of the last decode. the library only keeps them
+ * when built with JD_STATS, JD_ERROR and all 0 otherwise, other builds
+ * pay nothing for them.
+ */
+JD_API int jd_get_stats(const struct s_jctx *j, struct s_jstats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,977 @@
+// by suchang, 2014/11/22
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "jpeg_dec.h"
+
+struct s_sink {
+    const char *path;
+    FILE *fp;
+};
+
+// rows go straight to the ppm as they are decoded
+static void
+_save_rows(void *user, const struct s_jinfo *info, const unsigned char *rows, int y, int lines) {
+    struct s_sink *s = user;
+    if (y == 0) {
+        s->fp = fopen(s->path, "wb");
+        if ( s->fp ) {
+            fprintf(s->fp, "P%d\n", info->comps==1 ? 5 : 6);
+            fprintf(s->fp, "%d %d\n255\n", info->width, info->height);
+        }
+    }
+    if ( s->fp )
+        fwrite(rows, 1, (size_t)info->width * lines * info->comps, s->fp);
+}
+
+// decode a jpeg in memory into a ppm, 0 on failure
+static int
+_decode_mem(struct s_jctx *j, const unsigned char *data, size_t len, const char *out) {
+    struct s_sink s = { out, NULL };
+    int ret = jd_decode_rows(j, data, len, _save_rows, &s, NULL);
+    if (s.fp && fclose(s.fp) != 0)
+        ret = JD_ERROR;
+    if (ret != JD_OK || !s.fp) {
+        if ( s.fp ) remove(out);
+        return 0;
+    }
+    return 1;
+}
+
+// decode the content of file in into a ppm, its EXIF thumbnail with
+// thumb, 0 on failure
+static int
+_decode_content(struct s_jctx *j, const unsigned char *content, size_t length,
+                const char *in, const char *out, int thumb) {
+    struct s_jprobe pr;
+    int ok;
+    if ( thumb ) {
+        jd_probe(content, length, &pr);
+        ok = pr.thumb_len && _decode_mem(j, content + pr.thumb_offset, pr.thumb_len, out);
+    }
+    else {
+        ok = _decode_mem(j, content, length, out);
+    }
+    if ( !ok )
+        fprintf(stderr, "Fail to decode %s%s\n", thumb ? "the thumbnail of " : "", in);
+    return ok;
+}
+
+// decode one file into a ppm, returns input bytes, 0 on failure
+static size_t
+_decode_file(struct s_jctx *j, const char *in, const char *out, int thumb) {
+    size_t length = 0;
+    const unsigned char *content = jd_map_file( in, &length );
+    int ok;
+    if ( !content ) {
+        fprintf(stderr, "Can not map %s\n", in);
+        return 0;
+    }
+    ok = _decode_content(j, content, length, in, out, thumb);
+    jd_unmap_file( content, length );
+    return ok ? length : 0;
+}
+
+// Y, Cb, Cr planes one after the other into a raw file (I420 for 2x2
+// chroma), 0 on failure
+static int
+_decode_planes_file(struct s_jctx *j, const char *in, const char *out) {
+    struct s_jinfo info;
+    struct s_jplanes pl;
+    size_t length = 0, size = 0;
+    const unsigned char *content = jd_map_file( in, &length );
+    unsigned char *buf = NULL;
+    FILE *fp = NULL;
+    int i, ret = JD_ERROR;
+    if ( !content ) {
+        fprintf(stderr, "Can not map %s\n", in);
+        return 0;
+    }
+    memset(&pl, 0, sizeof(pl));
+    if (jd_decode_planes(j, content, length, NULL, &info) == JD_ESIZE) {
+        for (i=0; i<info.comps; i++)
+            size += (size_t)info.plane_w[i] * info.plane_h[i];
+        buf = malloc(size);
+    }
+    if ( buf ) {
+        unsigned char *p = buf;
+        for (i=0; i<info.comps; i++) {
+            pl.plane[i] = p;
+            pl.stride[i] = info.plane_w[i];
+            p += (size_t)info.plane_w[i] * info.plane_h[i];
+        }
+        ret = jd_decode_planes(j, content, length, &pl, &info);
+    }
+    jd_unmap_file( content, length );
+    if (ret == JD_OK && (fp = fopen(out, "wb")) != NULL) {
+        if (fwrite(buf, 1, size, fp) != size)
+            ret = JD_ERROR;
+        if (fclose(fp) != 0)
+            ret = JD_ERROR;
+    }
+    free(buf);
+    if (ret != JD_OK || !fp) {
+        fprintf(stderr, "Fail to decode %s\n", in);
+        return 0;
+    }
+    printf("# Save to %s ok,", out);
+    for (i=0; i<info.comps; i++)
+        printf(" %dx%d", info.plane_w[i], info.plane_h[i]);
+    printf(" #\n");
+    return 1;
+}
+
+// lossless transform into a jpeg, by name or as EXIF orientation asks
+static int
+_transform_file(struct s_jctx *j, const char *in, const char *out, const char *name) {
+    static const char *names[JD_XFORMS] = {
+        "none", "flip-h", "180", "flip-v", "transpose", "90", "transverse", "270",
+    };
+    struct s_jprobe pr;
+    size_t length = 0, used = 0;
+    const unsigned char *content = jd_map_file( in, &length );
+    unsigned char *buf = NULL;
+    FILE *fp = NULL;
+    int x, ret = JD_ERROR;
+    if ( !content ) {
+        fprintf(stderr, "Can not map %s\n", in);
+        return 1;
+    }
+    for (x=0; x<JD_XFORMS && strcmp(name, names[x]); x++);
+    if (!strcmp(name, "auto")) {
+        jd_probe(content, length, &pr);
+        x = pr.orientation >= 1 && pr.orientation <= JD_XFORMS ? pr.orientation - 1 : JD_XFORM_NONE;
+    }
+    if (x == JD_XFORMS) {
+        fprintf(stderr, "Unknown transform %s\n", name);
+        jd_unmap_file( content, length );
+        return 1;
+    }
+    // the output is about the size of the input
+    used = length + length / 8 + 1024;
+    do {
+        unsigned char *p = realloc(buf, used);
+        if ( !p ) break;
+        buf = p;
+        ret = jd_transform(j, content, length, x, buf, used, &used);
+    } while (ret == JD_ESIZE);
+    jd_unmap_file( content, length );
+    if (ret == JD_OK && (fp = fopen(out, "wb")) != NULL) {
+        if (fwrite(buf, 1, used, fp) != used)
+            ret = JD_ERROR;
+        if (fclose(fp) != 0)
+            ret = JD_ERROR;
+    }
+    free(buf);
+    if (ret != JD_OK || !fp) {
+        fprintf(stderr, "Fail to transform %s\n", in);
+        return 1;
+    }
+    printf("# Save %s to %s ok, %zu bytes #\n", names[x], out, used);
+    return 0;
+}
+
+static void
+_drop_rows(void *user, const struct s_jinfo *info, const unsigned char *rows, int y, int lines) {
+    (void)user; (void)info; (void)rows; (void)y; (void)lines;
+}
+
+// MJPEG, frames back to back from a file or stdin, each to outdir/frame-N.ppm
+// or only decoded. the buffer only grows to hold the largest frame
+static int
+_stream_file(struct s_jctx *j, const char *in, const char *outdir) {
+    size_t cap = 1 << 20, len = 0, pos = 0, start, end, bytes = 0;
+    unsigned char *buf = malloc(cap);
+    int fd = strcmp(in, "-") ? open(in, O_RDONLY) : 0;
+    int frames = 0, bad = 0, eof = 0;
+    struct timespec t0, t1;
+    double sec;
+    if (fd < 0 || !buf) {
+        fprintf(stderr, "Can not read %s\n", in);
+        free(buf);
+        return 1;
+    }
+    jd_set_stream(j, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ( !eof ) {
+        ssize_t n;
+        while (jd_find_frame(buf + pos, len - pos, &start, &end) == JD_OK) {
+            int ok;
+            if ( outdir ) {
+                char out[4096];
+                snprintf(out, sizeof(out), "%s/frame-%06d.ppm", outdir, frames);
+                ok = _decode_mem(j, buf + pos + start, end - start, out);
+            }
+            else {
+                ok = jd_decode_rows(j, buf + pos + start, end - start, _drop_rows, NULL, NULL) == JD_OK;
+            }
+            if ( !ok ) {
+                fprintf(stderr, "Fail to decode frame %d\n", frames);
+                bad++;
+            }
+            frames++;
+            bytes += end - start;
+            pos += end;
+        }
+        pos += start;
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+        pos = 0;
+        if (len == cap) {
+            unsigned char *p = realloc(buf, cap * 2);
+            if ( !p ) break;
+            buf = p;
+            cap *= 2;
+        }
+        n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            eof = 1;
+        else
+            len += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if ( len )
+        fprintf(stderr, "%zu bytes after the last frame\n", len);
+    printf("# %d frames, %d failed, %.3f s, %.1f frames/s, %.1f MB/s #\n",
+           frames, bad, sec, sec > 0 ? frames / sec : 0.0, sec > 0 ? bytes / sec / 1e6 : 0.0);
+    if ( fd )
+        close(fd);
+    free(buf);
+    return bad || !frames;
+}
+
+// headers only, no decoding
+static int
+_probe_file(const char *in) {
+    struct s_jprobe pr;
+    size_t length = 0;
+    const unsigned char *content = jd_map_file( in, &length );
+    int i, ret;
+    if ( !content ) {
+        fprintf(stderr, "Can not map %s\n", in);
+        return 1;
+    }
+    ret = jd_probe(content, length, &pr);
+    jd_unmap_file( content, length );
+    printf("# %s: %dx%d, %d comps, %s, sampling", in, pr.width, pr.height, pr.comps,
+           pr.progressive ? "progressive" : "baseline");
+    for (i=0; i<pr.comps && i<4; i++)
+        printf(" %dx%d", pr.h_samp[i], pr.v_samp[i]);
+    printf(", restart %d", pr.restart_interval);
+    if ( pr.orientation )
+        printf(", orientation %d", pr.orientation);
+    printf("%s #\n", ret == JD_OK ? "" : ", not decodable");
+    for (i=0; i<pr.markers && i<JD_MAX_MARKERS; i++)
+        printf("#   %04x at %d, %d bytes #\n", pr.marker[i].marker, pr.marker[i].offset, pr.marker[i].length);
+    if ( pr.thumb_len )
+        printf("#   thumbnail at %zu, %zu bytes #\n", pr.thumb_offset, pr.thumb_len);
+    return ret == JD_OK ? 0 : 1;
+}
+
+struct s_opts {
+    int threads;
+    int scale;
+    int crop[4];
+    int thumb;                  /* decode the EXIF thumbnail instead */
+};
+
+static struct s_jctx*
+_create_decoder(const struct s_opts *o) {
+    struct s_jctx *j = jd_create();
+    if ( j ) {
+        jd_set_threads(j, o->threads);
+        jd_set_scale(j, o->scale);
+        jd_set_crop(j, o->crop[0], o->crop[1], o->crop[2], o->crop[3]);
+    }
+    return j;
+}
+
+// batch mode. inputs are collected first, each worker owns a range of
+// them and takes from its front; a worker out of work steals the back
+// half of the largest range left, so one huge image only holds up the
+// worker decoding it
+struct s_bworker;
+
+struct s_batch {
+    char **path;
+    int count;
+    int cap;
+    const char *outdir;
+    const struct s_opts *opts;
+    struct s_bworker *w;
+    int workers;
+};
+
+struct s_bworker {
+    struct s_batch *bt;
+    pthread_mutex_t lock;
+    int head, tail;             /* own range of path */
+    int done, failed;
+    size_t bytes;
+    pthread_t tid;
+    int started;
+};
+
+static void
+_batch_add(struct s_batch *bt, const char *path) {
+    if (bt->count == bt->cap) {
+        int cap = bt->cap ? bt->cap * 2 : 256;
+        char **p = realloc(bt->path, sizeof(*p) * cap);
+        if ( !p ) return;
+        bt->path = p;
+        bt->cap = cap;
+    }
+    if ((bt->path[bt->count] = strdup(path)) != NULL)
+        bt->count++;
+}
+
+static int
+_is_jpeg_name(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+// paths one a line, from a list file or stdin
+static void
+_batch_add_list(struct s_batch *bt, FILE *fp) {
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if ( line[0] )
+            _batch_add(bt, line);
+    }
+}
+
+static void
+_batch_add_arg(struct s_batch *bt, const char *arg) {
+    struct stat st;
+    if (!strcmp(arg, "-")) {
+        _batch_add_list(bt, stdin);
+    }
+    else if (arg[0] == '@') {
+        FILE *fp = fopen(arg + 1, "r");
+        if ( !fp ) {
+            fprintf(stderr, "Can not open list %s\n", arg + 1);
+            return;
+        }
+        _batch_add_list(bt, fp);
+        fclose(fp);
+    }
+    else if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(arg);
+        struct dirent *e;
+        char path[4096];
+        while (d && (e = readdir(d)) != NULL) {
+            if ( !_is_jpeg_name(e->d_name) )
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", arg, e->d_name);
+            _batch_add(bt, path);
+        }
+        if ( d ) closedir(d);
+    }
+    else {
+        _batch_add(bt, arg);
+    }
+}
+
+// out dir + input file name, .ppm for its extension
+static void
+_output_name(const char *outdir, const char *in, char *out, int len) {
+    const char *base = strrchr(in, '/');
+    const char *ext;
+    base = base ? base + 1 : in;
+    ext = strrchr(base, '.');
+    snprintf(out, len, "%s/%.*s.ppm", outdir, ext ? (int)(ext - base) : (int)strlen(base), base);
+}
+
+static int
+_batch_left(struct s_bworker *w) {
+    int n;
+    pthread_mutex_lock(&w->lock);
+    n = w->tail - w->head;
+    pthread_mutex_unlock(&w->lock);
+    return n;
+}
+
+static int
+_batch_next(struct s_bworker *w) {
+    struct s_batch *bt = w->bt;
+    int i, idx = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+        idx = w->head++;
+    pthread_mutex_unlock(&w->lock);
+    while (idx < 0) {
+        struct s_bworker *v = NULL;
+        int n, left = 0, head, tail;
+        for (i=0; i<bt->workers; i++) {
+            if (&bt->w[i] != w && (n = _batch_left(&bt->w[i])) > left) {
+                left = n;
+                v = &bt->w[i];
+            }
+        }
+        if ( !v )
+            break;              /* nothing left anywhere */
+        pthread_mutex_lock(&v->lock);
+        head = v->head;
+        tail = v->tail;
+        if (head < tail) {
+            v->tail = tail - (tail - head + 1) / 2;
+            head = v->tail;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (head < tail) {
+            pthread_mutex_lock(&w->lock);
+            w->head = head + 1;
+            w->tail = tail;
+            pthread_mutex_unlock(&w->lock);
+            idx = head;
+        }
+    }
+    return idx;
+}
+
+// batch input. each worker has the next READ_AHEAD files it takes read
+// through its own io_uring into registered slot buffers, so their bytes
+// are in memory by the time the one before is decoded. without io_uring
+// (old kernel, seccomp, JD_URING=0) a slot is filled by pread when its
+// file comes up. files larger than a slot are mapped as before
+#define READ_AHEAD 8
+#define READ_SLOT (1 << 20)
+
+struct s_uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;   /* cq_len 0 if in sq_ring */
+    unsigned queued;            /* reads not yet submitted */
+    int fixed;                  /* slot buffers registered */
+};
+
+struct s_rslot {
+    int idx;                    /* of bt->path */
+    int fd;
+    size_t len;                 /* 0 to map the file instead */
+    ssize_t got;                /* bytes read, -1 while in flight */
+    unsigned char *buf;
+};
+
+struct s_reader {
+    struct s_uring ring;
+    int uring;
+    int head, count;            /* slots in the order taken */
+    unsigned char *mem;
+    unsigned char *mem_ring;    /* slot buffers left to a broken ring */
+    struct s_rslot slot[READ_AHEAD];
+};
+
+// unmap what was mapped and close the ring
+static void
+_uring_exit(struct s_uring *r) {
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_len && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring, r->cq_len);
+    if (r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_len);
+    close(r->fd);
+}
+
+static int
+_uring_init(struct s_uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return 0;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = 0;
+    }
+    r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = !r->cq_len ? r->sq_ring :
+        mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             r->fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        _uring_exit(r);
+        return 0;
+    }
+    r->sq_tail = (unsigned*)((char*)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ring + p.cq_off.cqes);
+    return 1;
+}
+
+
+// queue a read of len bytes at buf into slot k, submitted by _uring_enter
+static void
+_uring_read(struct s_uring *r, int k, int fd, unsigned char *buf, size_t len) {
+    unsigned tail = *r->sq_tail, i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->buf_index = k;
+    sqe->user_data = k;
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+// submit what is queued, with wait until one read completes too. 0 if
+// the ring can not be used any more
+static int
+_uring_enter(struct s_uring *r, int wait) {
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0) {
+        r->queued -= n;
+        return 1;
+    }
+    return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+
+static void
+_reader_init(struct s_reader *rd) {
+    const char *env = getenv("JD_URING");
+    int k;
+    memset(rd, 0, sizeof(*rd));
+    rd->mem = malloc((size_t)READ_AHEAD * READ_SLOT);
+    if ( !rd->mem )
+        return;                 /* every file mapped */
+    for (k=0; k<READ_AHEAD; k++)
+        rd->slot[k].buf = rd->mem + (size_t)k * READ_SLOT;
+    if ((env && !strcmp(env, "0")) || !_uring_init(&rd->ring, READ_AHEAD))
+        return;
+    rd->uring = 1;
+    {
+        struct iovec iov[READ_AHEAD];
+        for (k=0; k<READ_AHEAD; k++) {
+            iov[k].iov_base = rd->slot[k].buf;
+            iov[k].iov_len = READ_SLOT;
+        }
+        // plain reads if the buffers can not be pinned
+        rd->ring.fixed = syscall(__NR_io_uring_register, rd->ring.fd,
+                                 IORING_REGISTER_BUFFERS, iov, READ_AHEAD) == 0;
+    }
+}
+
+// the ring broke down. reads in flight may still land in the slot
+// buffers, so those are left to them until the reader exits and the rest
+// of the files are read by pread into new ones
+static void
+_reader_fallback(struct s_reader *rd) {
+    int i;
+    fprintf(stderr, "io_uring failed, reading with pread\n");
+    _uring_exit(&rd->ring);
+    rd->uring = 0;
+    rd->mem_ring = rd->mem;
+    rd->mem = malloc((size_t)READ_AHEAD * READ_SLOT);
+    for (i=0; i<READ_AHEAD; i++) {
+        struct s_rslot *s = &rd->slot[i];
+        s->buf = rd->mem ? rd->mem + (size_t)i * READ_SLOT : NULL;
+        s->got = 0;
+        if ( !rd->mem )
+            s->len = 0;
+    }
+}
+
+static void
+_reader_exit(struct s_reader *rd) {
+    if ( rd->uring )
+        _uring_exit(&rd->ring);
+    free(rd->mem);
+    free(rd->mem_ring);
+}
+
+// take files until READ_AHEAD are open, reads of those that fit a slot
+// go to the ring at once
+static void
+_reader_fill(struct s_reader *rd, struct s_bworker *w) {
+    int idx, submit = 0;
+    while (rd->count < READ_AHEAD && (idx = _batch_next(w)) >= 0) {
+        int k = (rd->head + rd->count++) % READ_AHEAD;
+        struct s_rslot *s = &rd->slot[k];
+        struct stat st;
+        s->idx = idx;
+        s->len = 0;
+        s->got = 0;
+        s->fd = rd->mem ? open(w->bt->path[idx], O_RDONLY) : -1;
+        if (s->fd < 0)
+            continue;
+        if (fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= READ_SLOT)
+            s->len = st.st_size;
+        if (s->len && rd->uring) {
+            s->got = -1;
+            _uring_read(&rd->ring, k, s->fd, s->buf, s->len);
+            submit++;
+        }
+    }
+    if (submit && !_uring_enter(&rd->ring, 0))
+        _reader_fallback(rd);
+}
+
+// wait for the front slot, 0 if it is to be mapped
+static int
+_reader_wait(struct s_reader *rd) {
+    struct s_rslot *s = &rd->slot[rd->head];
+    struct s_uring *r = &rd->ring;
+    while (s->got < 0) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if ( !_uring_enter(r, 1) )
+                _reader_fallback(rd);
+            continue;
+        }
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            rd->slot[cqe->user_data].got = cqe->res < 0 ? 0 : cqe->res;
+        }
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    // short or failed reads are finished with pread
+    while (s->len && (size_t)s->got < s->len) {
+        ssize_t n = pread(s->fd, s->buf + s->got, s->len - s->got, s->got);
+        if (n <= 0)
+            break;
+        s->got += n;
+    }
+    return s->len && (size_t)s->got == s->len;
+}
+
+static void*
+_batch_worker(void *arg) {
+    struct s_bworker *w = arg;
+    struct s_batch *bt = w->bt;
+    struct s_jctx *j = _create_decoder(bt->opts);
+    struct s_reader rd;
+    char out[4096];
+    _reader_init(&rd);
+    while ( j ) {
+        struct s_rslot *s;
+        const char *in;
+        size_t n;
+        _reader_fill(&rd, w);
+        if ( !rd.count )
+            break;
+        s = &rd.slot[rd.head];
+        in = bt->path[s->idx];
+        _output_name(bt->outdir, in, out, sizeof(out));
+        if ( _reader_wait(&rd) )
+            n = _decode_content(j, s->buf, s->len, in, out, bt->opts->thumb) ? s->len : 0;
+        else
+            n = _decode_file(j, in, out, bt->opts->thumb);
+        if (s->fd >= 0)
+            close(s->fd);
+        rd.head = (rd.head + 1) % READ_AHEAD;
+        rd.count--;
+        if ( n ) {
+            w->done++;
+            w->bytes += n;
+        }
+        else {
+            w->failed++;
+        }
+    }
+    _reader_exit(&rd);
+    jd_destroy(j);
+    return NULL;
+}
+
+static int
+_batch_run(struct s_batch *bt, int workers) {
+    struct timespec t0, t1;
+    int i, done = 0, failed = 0;
+    size_t bytes = 0;
+    double sec;
+    if (workers > bt->count)
+        workers = bt->count > 0 ? bt->count : 1;
+    bt->workers = workers;
+    bt->w = calloc(workers, sizeof(*bt->w));
+    if ( !bt->w )
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<workers; i++) {
+        struct s_bworker *w = &bt->w[i];
+        w->bt = bt;
+        w->head = (int)((long long)bt->count * i / workers);
+        w->tail = (int)((long long)bt->count * (i + 1) / workers);
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    for (i=0; i<workers; i++)
+        bt->w[i].started = pthread_create(&bt->w[i].tid, NULL, _batch_worker, &bt->w[i]) == 0;
+    // a worker that can not start takes its range on this thread
+    for (i=0; i<workers; i++)
+        if ( !bt->w[i].started )
+            _batch_worker(&bt->w[i]);
+    for (i=0; i<workers; i++) {
+        if ( bt->w[i].started )
+            pthread_join(bt->w[i].tid, NULL);
+        done += bt->w[i].done;
+        failed += bt->w[i].failed;
+        bytes += bt->w[i].bytes;
+    }
+    for (i=0; i<workers; i++)
+        pthread_mutex_destroy(&bt->w[i].lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("# %d decoded, %d failed, %d workers, %.3f s, %.1f images/s, %.1f MB/s #\n",
+           done, failed, workers, sec, sec > 0 ? done / sec : 0.0,
+           sec > 0 ? bytes / sec / 1e6 : 0.0);
+    free(bt->w);
+    return failed ? 1 : 0;
+}
+
+// counters of a JD_STATS build of the library, for slow images
+static void
+_print_stats(const struct s_jstats *st) {
+    int k;
+    double last = 0;
+    for (k=0; k<64; k++)
+        last += (double)k * st->eob[k];
+    printf("# %llu blocks, %llu skipped, %llu restarts, %llu bytes, last coef %.2f on average #\n",
+           st->blocks, st->blocks_skipped, st->restarts, st->bytes,
+           st->blocks ? last / st->blocks : 0.0);
+    for (k=0; k<st->scans && k<JD_MAX_SCANS; k++) {
+        const struct s_jscan *sc = &st->scan[k];
+        printf("#   scan %d: %d comps, %d..%d, ah %d al %d, %.3f ms #\n", k, sc->comps,
+               sc->ss, sc->se, sc->ah, sc->al, (sc->end_ns - sc->start_ns) / 1e6);
+    }
+}
+
+// bench mode. every file is read into memory and decoded into a frame
+// buffer ITERS times after a warm up run, nothing is written, then ITERS
+// more times with the stage timers on for the split. one json object a
+// line per file and a last one for the corpus
+static int
+_cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// sorts v
+static void
+_print_dist(const char *name, double *v, int n) {
+    qsort(v, n, sizeof(*v), _cmp_double);
+    printf(", \"%s\": {\"min\": %.4f, \"median\": %.4f, \"p99\": %.4f}",
+           name, v[0], v[n / 2], v[(n * 99 + 99) / 100 - 1]);
+}
+
+struct s_bench {
+    int iters;
+    double *ms;                 /* total then each stage, iters apiece */
+    unsigned char *out;
+    size_t out_cap;
+    int files, failed;
+    double bytes, pixels, sec;  /* sums of the medians */
+};
+
+static void
+_bench_file(struct s_jctx *j, struct s_bench *bh, const char *path) {
+    static const char *stage_name[JD_STAGES] = { "parse_ms", "entropy_ms", "idct_ms", "color_ms" };
+    struct s_jinfo info;
+    size_t len = 0, need;
+    const unsigned char *map = jd_map_file(path, &len);
+    unsigned char *data = map ? malloc(len) : NULL;
+    int i, k, n = bh->iters, ret;
+    double ns[JD_STAGES], med;
+    if ( !data ) {
+        fprintf(stderr, "Can not read %s\n", path);
+        jd_unmap_file(map, len);
+        bh->failed++;
+        return;
+    }
+    memcpy(data, map, len);
+    jd_unmap_file(map, len);
+    // sizes the frame, then the warm up run
+    ret = jd_decode(j, data, len, NULL, 0, &info);
+    need = (size_t)info.width * info.height * info.comps;
+    if (ret == JD_ESIZE && need > bh->out_cap) {
+        unsigned char *p = realloc(bh->out, need);
+        if ( p ) {
+            bh->out = p;
+            bh->out_cap = need;
+        }
+    }
+    if (ret != JD_ESIZE || jd_decode(j, data, len, bh->out, bh->out_cap, &info) != JD_OK) {
+        fprintf(stderr, "Fail to decode %s\n", path);
+        free(data);
+        bh->failed++;
+        return;
+    }
+    for (i=0; i<n; i++) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        jd_decode(j, data, len, bh->out, bh->out_cap, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        bh->ms[i] = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    }
+    jd_set_stage_timing(j, 1);
+    for (i=0; i<n; i++) {
+        jd_decode(j, data, len, bh->out, bh->out_cap, NULL);
+        jd_stage_times(j, ns);
+        for (k=0; k<JD_STAGES; k++)
+            bh->ms[(k + 1) * n + i] = ns[k] / 1e6;
+    }
+    jd_set_stage_timing(j, 0);
+    printf("{\"file\": \"%s\", \"bytes\": %zu, \"width\": %d, \"height\": %d, \"iters\": %d",
+           path, len, info.width, info.height, n);
+    _print_dist("total_ms", bh->ms, n);
+    for (k=0; k<JD_STAGES; k++)
+        _print_dist(stage_name[k], &bh->ms[(k + 1) * n], n);
+    med = bh->ms[n / 2] / 1e3;
+    printf(", \"mb_s\": %.2f, \"mpix_s\": %.2f}\n",
+           len / med / 1e6, (double)info.width * info.height / med / 1e6);
+    bh->files++;
+    bh->bytes += len;
+    bh->pixels += (double)info.width * info.height;
+    bh->sec += med;
+    free(data);
+}
+
+static int
+_bench_run(struct s_batch *bt, const struct s_opts *opts, int iters) {
+    struct s_bench bh;
+    struct s_jctx *j = _create_decoder(opts);
+    int i;
+    memset(&bh, 0, sizeof(bh));
+    bh.iters = iters;
+    bh.ms = malloc(sizeof(double) * iters * (JD_STAGES + 1));
+    if (!j || !bh.ms) {
+        jd_destroy(j);
+        free(bh.ms);
+        return 1;
+    }
+    for (i=0; i<bt->count; i++)
+        _bench_file(j, &bh, bt->path[i]);
+    printf("{\"corpus\": %d, \"failed\": %d, \"iters\": %d, \"bytes\": %.0f, \"pixels\": %.0f, "
+           "\"median_ms\": %.4f, \"mb_s\": %.2f, \"mpix_s\": %.2f}\n",
+           bh.files, bh.failed, iters, bh.bytes, bh.pixels, bh.sec * 1e3,
+           bh.sec > 0 ? bh.bytes / bh.sec / 1e6 : 0.0, bh.sec > 0 ? bh.pixels / bh.sec / 1e6 : 0.0);
+    jd_destroy(j);
+    free(bh.ms);
+    free(bh.out);
+    return bh.failed ? 1 : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *prog = argv[0];
+    const char *outdir = NULL;
+    struct s_opts opts = { 1, 1, {0, 0, 0, 0}, 0 };
+    const char *mode = "";
+    const char *xform = NULL;
+    int jobs = 0, iters = 0;
+
+    while (argc > 2 && argv[1][0] == '-' && argv[1][1]) {
+        if (!strcmp(argv[1], "-t"))
+            opts.threads = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-s"))
+            opts.scale = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-c"))
+            sscanf(argv[2], "%d,%d,%d,%d", &opts.crop[0], &opts.crop[1], &opts.crop[2], &opts.crop[3]);
+        else if (!strcmp(argv[1], "-j"))
+            jobs = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-o"))
+            outdir = argv[2];
+        else if (!strcmp(argv[1], "-b"))
+            iters = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-m"))
+            mode = argv[2];
+        else if (!strcmp(argv[1], "-x"))
+            xform = argv[2];
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc < 2 || (argc > 2 && jobs <= 0 && iters <= 0)) {
+        printf("%s [-t THREADS] [-s 1|2|4|8] [-c X,Y,W,H] [-m probe|thumb|planes] FILE.JPG\n", prog);
+        printf("%s -x 90|180|270|flip-h|flip-v|transpose|transverse|auto [-c X,Y,W,H] FILE.JPG\n", prog);
+        printf("%s -m stream [-o DIR] [options] FILE.MJPEG|-\n", prog);
+        printf("%s -j WORKERS [-o DIR] [options] FILE|DIR|@LIST|- ...\n", prog);
+        printf("%s -b ITERS [options] FILE|DIR|@LIST|- ...\n", prog);
+        return 0;
+    }
+    opts.thumb = !strcmp(mode, "thumb");
+    if (!strcmp(mode, "probe"))
+        return _probe_file(argv[1]);
+    if (opts.scale != 1 && opts.scale != 2 && opts.scale != 4 && opts.scale != 8) {
+        printf("Bad scale %d, decode at full size\n", opts.scale);
+        opts.scale = 1;
+    }
+
+    if (jobs > 0 || iters > 0) {
+        // every input to DIR/NAME.ppm, or timed in memory
+        struct s_batch bt;
+        int i, ret;
+        memset(&bt, 0, sizeof(bt));
+        bt.outdir = outdir ? outdir : ".";
+        bt.opts = &opts;
+        for (i=1; i<argc; i++)
+            _batch_add_arg(&bt, argv[i]);
+        ret = iters > 0 ? _bench_run(&bt, &opts, iters) : _batch_run(&bt, jobs);
+        for (i=0; i<bt.count; i++)
+            free(bt.path[i]);
+        free(bt.path);
+        return ret;
+    }
+    else {
+        struct s_jctx *j = _create_decoder(&opts);
+        struct s_jstats st;
+        if ( xform ) {
+            int ret = _transform_file(j, argv[1], "export.jpg", xform);
+            jd_destroy( j );
+            return ret;
+        }
+        if ( !strcmp(mode, "stream") ) {
+            int ret = _stream_file(j, argv[1], outdir);
+            jd_destroy( j );
+            return ret;
+        }
+        if ( !strcmp(mode, "planes") )
+            _decode_planes_file(j, argv[1], "export.yuv");
+        else if ( _decode_file(j, argv[1], "export.ppm", opts.thumb) )
+            printf("# Save to export.ppm ok #\n");
+        if (jd_get_stats(j, &st) == JD_OK)
+            _print_stats(&st);
+        jd_destroy( j );
+    }
+
+    return 0;
+}